@@ -0,0 +1,164 @@
+#pragma once
+
+#include "hazard.h"
+#include "lifetime.h"
+#include "shared.h"
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+// Lock-free slot holding a `SharedPtr`.
+//
+// The slot stores a pointer to an entry, a control block that owns a copy of the stored
+// `SharedPtr`. `Load` protects the entry with a hazard pointer of the calling thread and copies
+// the stored pointer out of it, so loaded pointers share ownership with the original control
+// block: `UseCount()`, `GetDeleter()` and `CompareExchange` behave as with the stored value.
+// Replaced entries are retired to the default `HazardDomain`; a writer trades a scan of the
+// hazard records for readers that never write to a shared cache line besides the count.
+template <typename T>
+class AtomicSharedPtr {
+    using Value = SharedPtr<T, AtomicRefCount>;
+    using Entry = ControlBlockEmplace<Value>;
+
+public:
+    static constexpr bool kIsAlwaysLockFree = std::atomic<Entry*>::is_always_lock_free;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    AtomicSharedPtr() : entry_(nullptr) {
+    }
+    AtomicSharedPtr(Value desired) : entry_(MakeEntry(std::move(desired))) {
+    }
+
+    AtomicSharedPtr(const AtomicSharedPtr& other) = delete;
+    AtomicSharedPtr& operator=(const AtomicSharedPtr& other) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    // No reader may be left, so the entry is released right away
+    ~AtomicSharedPtr() {
+        if (Entry* entry = entry_.load(std::memory_order_acquire)) {
+            entry->template ReleaseStrong<AtomicRefCount>();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Operations
+
+    Value Load() const {
+        if (entry_.load(std::memory_order_relaxed) == nullptr) {
+            return Value();
+        }
+        Reader reader;
+        Entry* entry = reader->Protect(entry_);
+        return entry ? *entry->GetRawPtr() : Value();
+    }
+    void Store(Value desired) {
+        Retire(entry_.exchange(MakeEntry(std::move(desired)), std::memory_order_acq_rel));
+    }
+    Value Exchange(Value desired) {
+        Entry* old = entry_.exchange(MakeEntry(std::move(desired)), std::memory_order_acq_rel);
+        if (old == nullptr) {
+            return Value();
+        }
+        // Readers may still be copying the value, so it can't be moved out
+        Value result = *old->GetRawPtr();
+        Retire(old);
+        return result;
+    }
+    // Succeeds if the current value holds the same pointer and control block as `expected`. On
+    // failure `expected` is replaced with the current value
+    bool CompareExchange(Value& expected, Value desired) {
+        Entry* new_entry = MakeEntry(std::move(desired));
+        Value current;
+        {
+            Reader reader;
+            Entry* entry = reader->Protect(entry_);
+            while (Matches(entry, expected)) {
+                if (entry_.compare_exchange_weak(entry, new_entry, std::memory_order_acq_rel,
+                                                 std::memory_order_relaxed)) {
+                    reader->Reset();
+                    Retire(entry);
+                    return true;
+                }
+                entry = reader->Protect(entry_);
+            }
+            if (entry != nullptr) {
+                current = *entry->GetRawPtr();
+            }
+        }
+        // Both may run arbitrary destructors, so they wait until the hazard is cleared
+        if (new_entry != nullptr) {
+            new_entry->template ReleaseStrong<AtomicRefCount>();
+        }
+        expected = std::move(current);
+        return false;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    bool IsLockFree() const {
+        return entry_.is_lock_free();
+    }
+
+private:
+    // The calling thread's hazard pointer, or a temporary one once the thread is shutting down.
+    // Clears the hazard when it goes out of scope
+    class Reader {
+    public:
+        Reader() : hp_(ThreadLocalInstance<HazardPointer>::Get()) {
+            if (hp_ == nullptr) {
+                hp_ = &fallback_.emplace();
+            }
+        }
+
+        Reader(const Reader& other) = delete;
+        Reader& operator=(const Reader& other) = delete;
+
+        ~Reader() {
+            if (!fallback_) {
+                hp_->Reset();
+            }
+        }
+
+        HazardPointer* operator->() const {
+            return hp_;
+        }
+
+    private:
+        HazardPointer* hp_;
+        std::optional<HazardPointer> fallback_;
+    };
+
+    static bool Matches(Entry* entry, const Value& expected) {
+        if (entry == nullptr) {
+            return expected.GetBlock() == nullptr && expected.Get() == nullptr;
+        }
+        const Value& value = *entry->GetRawPtr();
+        return value.GetBlock() == expected.GetBlock() && value.Get() == expected.Get();
+    }
+
+    // Only a value without a block needs no entry; a null pointer may still own something
+    static Entry* MakeEntry(Value value) {
+        if (value.GetBlock() == nullptr && value.Get() == nullptr) {
+            return nullptr;
+        }
+        return new Entry(std::move(value));
+    }
+
+    // Scans right away, so only a value that a reader is copying at that moment is left for a
+    // later scan
+    static void Retire(Entry* entry) {
+        if (entry != nullptr) {
+            HazardDomain& domain = HazardDomain::Default();
+            domain.Retire(entry);
+            domain.Reclaim();
+        }
+    }
+
+    std::atomic<Entry*> entry_;
+};
@@ -0,0 +1,726 @@
+// Benchmarks of the smart pointers against their `std::` counterparts.
+//
+// Build and run:
+//     g++ -std=c++17 -O2 -pthread bench.cpp -o bench && ./bench > bench_output.txt
+//
+// Every result is printed as one JSON object per line:
+//     {"benchmark": "shared_copy", "impl": "sw", "threads": 1, "ns_per_op": 1.23}
+// Optional arguments: a substring that benchmark names have to contain, and the largest thread
+// count for the contention benchmarks (hardware concurrency by default).
+//
+// Single-threaded `sw` results use the default `NonAtomicRefCount` policy, the contention
+// benchmark uses `AtomicRefCount`. `std::shared_ptr` is always atomic in a threaded program.
+
+#include "atomic_shared.h"
+#include "compact.h"
+#include "distributed.h"
+#include "object_pool.h"
+#include "relocating_vector.h"
+#include "serialize.h"
+#include "shared.h"
+#include "unique.h"
+#include "weak.h"
+#include "weak_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+template <typename T>
+void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+const char* filter = "";
+
+// Best of several runs, in nanoseconds per iteration
+template <typename F>
+double Measure(size_t iters, F&& body) {
+    double best = 1e300;
+    for (int run = 0; run < 5; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        body(iters);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / iters);
+    }
+    return best;
+}
+
+// Same, but `setup(iters)` runs outside of the timed region
+template <typename S, typename F>
+double Measure(size_t iters, S&& setup, F&& body) {
+    double best = 1e300;
+    for (int run = 0; run < 5; ++run) {
+        setup(iters);
+        auto start = std::chrono::steady_clock::now();
+        body(iters);
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / iters);
+    }
+    return best;
+}
+
+void Report(const char* name, const char* impl, int threads, double ns) {
+    std::printf("{\"benchmark\": \"%s\", \"impl\": \"%s\", \"threads\": %d, \"ns_per_op\": %.3f}\n",
+                name, impl, threads, ns);
+    std::fflush(stdout);
+}
+
+void ReportBytes(const char* name, const char* impl, size_t bytes) {
+    std::printf("{\"benchmark\": \"%s\", \"impl\": \"%s\", \"threads\": 1, \"bytes\": %zu}\n", name,
+                impl, bytes);
+    std::fflush(stdout);
+}
+
+bool Enabled(const char* name) {
+    return std::strstr(name, filter) != nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Both libraries behind one interface
+
+struct Payload {
+    int value = 0;
+};
+
+struct SelfPayload;
+struct StdSelfPayload;
+
+struct Sw {
+    static constexpr const char* kName = "sw";
+
+    template <typename T>
+    using Shared = SharedPtr<T>;
+    template <typename T>
+    using Weak = WeakPtr<T>;
+    using AtomicShared = SharedPtr<Payload, AtomicRefCount>;
+    using Self = SelfPayload;
+
+    template <typename T, typename D = DefaultDeleter<T>>
+    using Unique = UniquePtr<T, D>;
+
+    template <typename T>
+    static Shared<T> Make() {
+        return MakeShared<T>();
+    }
+    template <typename T>
+    static Shared<T> New() {
+        return Shared<T>(new T());
+    }
+    static AtomicShared MakeAtomic() {
+        return MakeShared<Payload, AtomicRefCount>();
+    }
+    template <typename T>
+    static Shared<T> Lock(const Weak<T>& weak) {
+        return weak.Lock();
+    }
+    static Shared<SelfPayload> FromThis(SelfPayload& self);
+    template <typename P>
+    static void Reset(P& ptr) {
+        ptr.Reset();
+    }
+    template <typename P, typename T>
+    static void Reset(P& ptr, T* raw) {
+        ptr.Reset(raw);
+    }
+};
+
+// Only used by the contention benchmark: the shared object is immortal
+struct SwImmortal : public Sw {
+    static constexpr const char* kName = "sw_immortal";
+
+    static AtomicShared MakeAtomic() {
+        return MakeImmortalShared<Payload, AtomicRefCount>();
+    }
+};
+
+// Only used by the contention benchmark: the shared object counts per shard
+struct SwDistributed : public Sw {
+    static constexpr const char* kName = "sw_distributed";
+
+    static AtomicShared MakeAtomic() {
+        return MakeSharedDistributed<Payload>();
+    }
+};
+
+struct Std {
+    static constexpr const char* kName = "std";
+
+    template <typename T>
+    using Shared = std::shared_ptr<T>;
+    template <typename T>
+    using Weak = std::weak_ptr<T>;
+    using AtomicShared = std::shared_ptr<Payload>;
+    using Self = StdSelfPayload;
+
+    template <typename T, typename D = std::default_delete<T>>
+    using Unique = std::unique_ptr<T, D>;
+
+    template <typename T>
+    static Shared<T> Make() {
+        return std::make_shared<T>();
+    }
+    template <typename T>
+    static Shared<T> New() {
+        return Shared<T>(new T());
+    }
+    static AtomicShared MakeAtomic() {
+        return std::make_shared<Payload>();
+    }
+    template <typename T>
+    static Shared<T> Lock(const Weak<T>& weak) {
+        return weak.lock();
+    }
+    static Shared<StdSelfPayload> FromThis(StdSelfPayload& self);
+    template <typename P>
+    static void Reset(P& ptr) {
+        ptr.reset();
+    }
+    template <typename P, typename T>
+    static void Reset(P& ptr, T* raw) {
+        ptr.reset(raw);
+    }
+};
+
+struct SelfPayload : public EnableSharedFromThis<SelfPayload> {
+    int value = 0;
+};
+struct StdSelfPayload : public std::enable_shared_from_this<StdSelfPayload> {
+    int value = 0;
+};
+
+Sw::Shared<SelfPayload> Sw::FromThis(SelfPayload& self) {
+    return self.SharedFromThis();
+}
+Std::Shared<StdSelfPayload> Std::FromThis(StdSelfPayload& self) {
+    return self.shared_from_this();
+}
+
+// Deleter with state, so it can't be compressed away
+struct StatefulDeleter {
+    template <typename T>
+    void operator()(T* ptr) const {
+        calls->fetch_add(1, std::memory_order_relaxed);
+        delete ptr;
+    }
+
+    std::atomic<size_t>* calls;
+};
+
+std::atomic<size_t> deleter_calls{0};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Single-threaded benchmarks
+
+constexpr size_t kIters = 1 << 22;
+constexpr size_t kAllocIters = 1 << 20;
+
+template <typename Impl>
+void RunSingleThreaded() {
+    if (Enabled("shared_copy")) {
+        auto ptr = Impl::template Make<Payload>();
+        Report("shared_copy", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto copy = ptr;
+                       DoNotOptimize(copy);
+                   }
+               }));
+    }
+    if (Enabled("shared_move")) {
+        auto a = Impl::template Make<Payload>();
+        auto b = Impl::template Make<Payload>();
+        Report("shared_move", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       b = std::move(a);
+                       a = std::move(b);
+                       DoNotOptimize(a);
+                   }
+               }));
+    }
+    if (Enabled("shared_destroy")) {
+        std::vector<typename Impl::template Shared<Payload>> ptrs;
+        auto setup = [&](size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                ptrs.push_back(Impl::template Make<Payload>());
+            }
+        };
+        Report("shared_destroy", Impl::kName, 1, Measure(kAllocIters, setup, [&](size_t) {
+                   ptrs.clear();
+                   DoNotOptimize(ptrs);
+               }));
+    }
+    if (Enabled("make_shared")) {
+        Report("make_shared", Impl::kName, 1, Measure(kAllocIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto ptr = Impl::template Make<Payload>();
+                       DoNotOptimize(ptr);
+                   }
+               }));
+    }
+    if (Enabled("shared_new")) {
+        Report("shared_new", Impl::kName, 1, Measure(kAllocIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto ptr = Impl::template New<Payload>();
+                       DoNotOptimize(ptr);
+                   }
+               }));
+    }
+    if (Enabled("weak_lock")) {
+        auto ptr = Impl::template Make<Payload>();
+        typename Impl::template Weak<Payload> weak(ptr);
+        Report("weak_lock", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto locked = Impl::Lock(weak);
+                       DoNotOptimize(locked);
+                   }
+               }));
+    }
+    if (Enabled("shared_from_this")) {
+        auto ptr = Impl::template Make<typename Impl::Self>();
+        Report("shared_from_this", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto self = Impl::FromThis(*ptr);
+                       DoNotOptimize(self);
+                   }
+               }));
+    }
+    // Same as `shared_copy` and `make_shared`, for a type deriving from `EnableSharedFromThis`
+    if (Enabled("shared_copy_self")) {
+        auto ptr = Impl::template Make<typename Impl::Self>();
+        Report("shared_copy_self", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto copy = ptr;
+                       DoNotOptimize(copy);
+                   }
+               }));
+    }
+    if (Enabled("make_shared_self")) {
+        Report("make_shared_self", Impl::kName, 1, Measure(kAllocIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       auto ptr = Impl::template Make<typename Impl::Self>();
+                       DoNotOptimize(ptr);
+                   }
+               }));
+    }
+    if (Enabled("unique_move")) {
+        typename Impl::template Unique<Payload> a(new Payload());
+        typename Impl::template Unique<Payload> b;
+        Report("unique_move", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       b = std::move(a);
+                       a = std::move(b);
+                       DoNotOptimize(a);
+                   }
+               }));
+    }
+    if (Enabled("unique_move_stateful")) {
+        using Unique = typename Impl::template Unique<Payload, StatefulDeleter>;
+        Unique a(new Payload(), StatefulDeleter{&deleter_calls});
+        Unique b(nullptr, StatefulDeleter{&deleter_calls});
+        Report("unique_move_stateful", Impl::kName, 1, Measure(kIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       b = std::move(a);
+                       a = std::move(b);
+                       DoNotOptimize(a);
+                   }
+               }));
+    }
+    if (Enabled("unique_reset")) {
+        typename Impl::template Unique<Payload> ptr;
+        Report("unique_reset", Impl::kName, 1, Measure(kAllocIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       Impl::Reset(ptr, new Payload());
+                       DoNotOptimize(ptr);
+                   }
+                   Impl::Reset(ptr);
+               }));
+    }
+    if (Enabled("unique_reset_stateful")) {
+        typename Impl::template Unique<Payload, StatefulDeleter> ptr(
+            nullptr, StatefulDeleter{&deleter_calls});
+        Report("unique_reset_stateful", Impl::kName, 1, Measure(kAllocIters, [&](size_t n) {
+                   for (size_t i = 0; i < n; ++i) {
+                       Impl::Reset(ptr, new Payload());
+                       DoNotOptimize(ptr);
+                   }
+                   Impl::Reset(ptr);
+               }));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Contention: every thread copies the same pointer
+
+template <typename Impl>
+void RunContention(int max_threads) {
+    if (!Enabled("shared_copy_contended")) {
+        return;
+    }
+    constexpr size_t kContendedIters = 1 << 20;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        auto ptr = Impl::MakeAtomic();
+        double ns = Measure(kContendedIters, [&](size_t n) {
+            std::atomic<int> ready{0};
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; ++t) {
+                workers.emplace_back([&] {
+                    ready.fetch_add(1);
+                    while (ready.load() < threads) {
+                    }
+                    for (size_t i = 0; i < n; ++i) {
+                        auto copy = ptr;
+                        DoNotOptimize(copy);
+                    }
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        });
+        Report("shared_copy_contended", Impl::kName, threads, ns);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Readers of a shared slot: `AtomicSharedPtr::Load` against a `SharedPtr` behind a mutex
+
+template <typename Load>
+double MeasureReaders(int threads, Load load) {
+    constexpr size_t kReads = 1 << 18;
+    return Measure(kReads, [&](size_t n) {
+        std::atomic<int> ready{0};
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([&] {
+                ready.fetch_add(1);
+                while (ready.load() < threads) {
+                }
+                for (size_t i = 0; i < n; ++i) {
+                    auto copy = load();
+                    DoNotOptimize(copy);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    });
+}
+
+void RunAtomicLoad(int max_threads) {
+    if (!Enabled("atomic_load")) {
+        return;
+    }
+    AtomicSharedPtr<Payload> slot(MakeShared<Payload, AtomicRefCount>());
+    std::mutex mutex;
+    SharedPtr<Payload, AtomicRefCount> guarded = MakeShared<Payload, AtomicRefCount>();
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        Report("atomic_load", "sw", threads, MeasureReaders(threads, [&] {
+                   return slot.Load();
+               }));
+        Report("atomic_load", "sw_mutex", threads, MeasureReaders(threads, [&] {
+                   std::lock_guard<std::mutex> lock(mutex);
+                   return guarded;
+               }));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lookups of live objects in a `WeakCache` from many threads
+
+void RunWeakCache(int max_threads) {
+    if (!Enabled("weak_cache_get")) {
+        return;
+    }
+    constexpr size_t kKeys = 1 << 10;
+    constexpr size_t kLookups = 1 << 18;
+    for (size_t shards : {size_t{1}, size_t{16}}) {
+        WeakCache<size_t, Payload> cache(shards);
+        std::vector<SharedPtr<Payload, AtomicRefCount>> live;
+        auto make = [] { return MakeShared<Payload, AtomicRefCount>(); };
+        for (size_t key = 0; key < kKeys; ++key) {
+            live.push_back(cache.GetOrCreate(key, make));
+        }
+        std::string impl = "sw_" + std::to_string(shards) + "_shards";
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            double ns = Measure(kLookups, [&](size_t n) {
+                std::vector<std::thread> workers;
+                for (int t = 0; t < threads; ++t) {
+                    workers.emplace_back([&, t] {
+                        for (size_t i = 0; i < n; ++i) {
+                            auto found = cache.Find((i * 31 + t) % kKeys);
+                            DoNotOptimize(found);
+                        }
+                    });
+                }
+                for (auto& worker : workers) {
+                    worker.join();
+                }
+            });
+            Report("weak_cache_get", impl.c_str(), threads, ns);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// One message handed to many subscribers and released again, atomic counts
+
+void RunFanOut() {
+    if (!Enabled("fan_out")) {
+        return;
+    }
+    constexpr size_t kSubscribers = 1 << 10;
+    constexpr size_t kRounds = 1 << 10;
+    auto sw = MakeShared<Payload, AtomicRefCount>();
+    std::vector<SharedPtr<Payload, AtomicRefCount>> sw_out(kSubscribers);
+    Report("fan_out", "sw", 1, Measure(kRounds, [&](size_t n) {
+               for (size_t round = 0; round < n; ++round) {
+                   for (auto& subscriber : sw_out) {
+                       subscriber = sw;
+                   }
+                   for (auto& subscriber : sw_out) {
+                       subscriber.Reset();
+                   }
+               }
+           }) / kSubscribers);
+    Report("fan_out", "sw_batch", 1, Measure(kRounds, [&](size_t n) {
+               for (size_t round = 0; round < n; ++round) {
+                   ShareN(sw, kSubscribers, sw_out.begin());
+                   ReleaseBatch(sw_out.data(), sw_out.size());
+               }
+           }) / kSubscribers);
+
+    auto std_ptr = std::make_shared<Payload>();
+    std::vector<std::shared_ptr<Payload>> std_out(kSubscribers);
+    Report("fan_out", "std", 1, Measure(kRounds, [&](size_t n) {
+               for (size_t round = 0; round < n; ++round) {
+                   for (auto& subscriber : std_out) {
+                       subscriber = std_ptr;
+                   }
+                   for (auto& subscriber : std_out) {
+                       subscriber.reset();
+                   }
+               }
+           }) / kSubscribers);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// A parser's scratch buffer: acquired, filled and released again
+
+struct ScratchBuffer {
+    std::vector<char> bytes;
+};
+
+void RunObjectPool() {
+    if (!Enabled("pool_acquire")) {
+        return;
+    }
+    constexpr size_t kIters = 1 << 18;
+    constexpr size_t kBytes = 1 << 10;
+    auto fill = [](ScratchBuffer& buffer) {
+        buffer.bytes.resize(kBytes);
+        DoNotOptimize(buffer.bytes.data());
+    };
+    Report("pool_acquire", "sw", 1, Measure(kIters, [&](size_t n) {
+               for (size_t i = 0; i < n; ++i) {
+                   auto buffer = MakeShared<ScratchBuffer>();
+                   fill(*buffer);
+               }
+           }));
+    ObjectPool<ScratchBuffer> pool(ObjectPoolOptions(),
+                                   [](ScratchBuffer& buffer) { buffer.bytes.clear(); });
+    Report("pool_acquire", "sw_pool", 1, Measure(kIters, [&](size_t n) {
+               for (size_t i = 0; i < n; ++i) {
+                   auto buffer = pool.Acquire();
+                   fill(*buffer);
+               }
+           }));
+    Report("pool_acquire", "sw_pool_unique", 1, Measure(kIters, [&](size_t n) {
+               for (size_t i = 0; i < n; ++i) {
+                   auto buffer = pool.AcquireUnique();
+                   fill(*buffer);
+               }
+           }));
+    Report("pool_acquire", "std", 1, Measure(kIters, [&](size_t n) {
+               for (size_t i = 0; i < n; ++i) {
+                   auto buffer = std::make_shared<ScratchBuffer>();
+                   fill(*buffer);
+               }
+           }));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Restoring a checkpointed graph where every node is shared by two parents
+
+struct GraphNode {
+    int value = 0;
+    SharedPtr<GraphNode> left;
+    SharedPtr<GraphNode> right;
+};
+
+void SaveNode(GraphWriter& out, const GraphNode& node) {
+    out.Write(node.value);
+    out.Write(node.left);
+    out.Write(node.right);
+}
+void LoadNode(GraphReader& in, GraphNode& node) {
+    in.Read(node.value);
+    in.Read(node.left);
+    in.Read(node.right);
+}
+
+void RunGraphLoad() {
+    if (!Enabled("graph_load")) {
+        return;
+    }
+    constexpr size_t kNodes = 1 << 16;
+    // A ladder: node i points to i + 1 and i + 2
+    std::vector<SharedPtr<GraphNode>> nodes(kNodes);
+    for (size_t i = kNodes; i-- > 0;) {
+        nodes[i] = MakeShared<GraphNode>();
+        nodes[i]->value = static_cast<int>(i);
+        if (i + 1 < kNodes) {
+            nodes[i]->left = nodes[i + 1];
+        }
+        if (i + 2 < kNodes) {
+            nodes[i]->right = nodes[i + 2];
+        }
+    }
+    GraphWriter writer;
+    writer.AddRoot(nodes[0]);
+    std::vector<char> image = writer.Finish();
+
+    // Rebuilds the same graph by hand from the view, the reader without its bookkeeping
+    auto rebuild = [&](const GraphView& view) {
+        std::vector<SharedPtr<GraphNode>> built(view.NodeCount());
+        for (size_t i = view.NodeCount(); i-- > 0;) {
+            GraphPayload payload = view.Payload(i);
+            built[i] = MakeShared<GraphNode>();
+            built[i]->value = payload.Read<int>();
+            uint32_t left = payload.ReadEdge();
+            uint32_t right = payload.ReadEdge();
+            if (left != kGraphNull) {
+                built[i]->left = built[view.Edge(left).node];
+            }
+            if (right != kGraphNull) {
+                built[i]->right = built[view.Edge(right).node];
+            }
+        }
+        return built;
+    };
+    Report("graph_load", "sw_rebuild", 1, Measure(1, [&](size_t n) {
+               for (size_t i = 0; i < n; ++i) {
+                   GraphView view(image.data(), image.size());
+                   auto built = rebuild(view);
+                   DoNotOptimize(built);
+               }
+           }) / kNodes);
+    Report("graph_load", "sw_reader", 1, Measure(1, [&](size_t n) {
+               for (size_t i = 0; i < n; ++i) {
+                   GraphView view(image.data(), image.size());
+                   GraphReader reader(view);
+                   auto root = reader.Root<GraphNode>(0);
+                   DoNotOptimize(root);
+               }
+           }) / kNodes);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Dense arrays of handles: memory per handle and a pass over all objects
+
+template <typename Handle, typename Make>
+void RunHandleArray(const char* impl, Make make) {
+    constexpr size_t kHandles = 1 << 20;
+    if (Enabled("handle_bytes")) {
+        ReportBytes("handle_bytes", impl, sizeof(Handle));
+    }
+    if (!Enabled("handle_iterate")) {
+        return;
+    }
+    std::vector<Handle> handles;
+    handles.reserve(kHandles);
+    for (size_t i = 0; i < kHandles; ++i) {
+        handles.push_back(make());
+    }
+    Report("handle_iterate", impl, 1, Measure(kHandles, [&](size_t n) {
+               int sum = 0;
+               for (size_t i = 0; i < n; ++i) {
+                   sum += handles[i]->value;
+               }
+               DoNotOptimize(sum);
+           }));
+}
+
+// Appending without `reserve`: every reallocation moves all handles so far
+template <typename Vector, typename Make>
+void RunHandleGrow(const char* impl, Make make) {
+    if (!Enabled("handle_grow")) {
+        return;
+    }
+    constexpr size_t kHandles = 1 << 16;
+    auto handle = make();
+    Report("handle_grow", impl, 1, Measure(kHandles, [&](size_t n) {
+               Vector handles;
+               for (size_t i = 0; i < n; ++i) {
+                   handles.push_back(handle);
+               }
+               DoNotOptimize(handles);
+           }));
+}
+
+template <typename T>
+struct RelocatingAdapter : public RelocatingVector<T> {
+    void push_back(const T& value) {
+        this->PushBack(value);
+    }
+};
+
+void RunHandleArrays() {
+    RunHandleArray<SharedPtr<Payload>>("sw", [] { return MakeShared<Payload>(); });
+    RunHandleArray<CompactSharedPtr<Payload>>("sw_compact",
+                                              [] { return MakeCompactShared<Payload>(); });
+    RunHandleArray<std::shared_ptr<Payload>>("std", [] { return std::make_shared<Payload>(); });
+
+    RunHandleGrow<std::vector<SharedPtr<Payload>>>("sw", [] { return MakeShared<Payload>(); });
+    RunHandleGrow<RelocatingAdapter<SharedPtr<Payload>>>("sw_relocating",
+                                                         [] { return MakeShared<Payload>(); });
+    RunHandleGrow<std::vector<std::shared_ptr<Payload>>>(
+        "std", [] { return std::make_shared<Payload>(); });
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        filter = argv[1];
+    }
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (argc > 2) {
+        max_threads = std::max(1, std::atoi(argv[2]));
+    }
+
+    RunSingleThreaded<Sw>();
+    RunSingleThreaded<Std>();
+    RunContention<Sw>(max_threads);
+    RunContention<SwImmortal>(max_threads);
+    RunContention<SwDistributed>(max_threads);
+    RunContention<Std>(max_threads);
+    RunAtomicLoad(max_threads);
+    RunWeakCache(max_threads);
+    RunFanOut();
+    RunObjectPool();
+    RunGraphLoad();
+    RunHandleArrays();
+    return 0;
+}
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "shared.h"
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+// Biased reference counting.
+//
+// A biased block belongs to the thread that created it. The owner updates a local count with
+// plain loads and stores, every other thread uses an atomic shared count. Since references
+// migrate between threads, the shared count may go below zero; the first thread that sees
+// that queues the block to its owner, which merges both counts the next time it calls
+// `MergeBiasedRefCounts()` (also done by `MakeSharedBiased` and at thread exit). The owner
+// merges on its own when its local count drops to zero. After a merge the block behaves as a
+// plain atomic counter.
+
+struct BiasedControlBlockBase;
+
+struct BiasedQueue {
+    // Pushed by other threads, drained by the owner
+    std::atomic<BiasedControlBlockBase*> head{nullptr};
+    // The owner thread and every block that is still biased towards it
+    std::atomic<size_t> refs{1};
+
+    static BiasedControlBlockBase* Closed() {
+        return reinterpret_cast<BiasedControlBlockBase*>(uintptr_t{1});
+    }
+
+    void AddRef() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    void Drain(BiasedControlBlockBase* replacement);
+
+    static BiasedQueue*& Current() {
+        thread_local BiasedQueue* queue = nullptr;
+        return queue;
+    }
+    static BiasedQueue* ForCurrentThread();
+};
+
+struct BiasedControlBlockBase : public ControlBlockBase {
+    static constexpr uint64_t kMerged = uint64_t{1} << 63;
+    static constexpr uint64_t kQueued = uint64_t{1} << 62;
+    // The shared count is stored with this offset, so it can go below zero
+    static constexpr uint64_t kZero = uint64_t{1} << 60;
+    static constexpr uint64_t kCountMask = (uint64_t{1} << 61) - 1;
+
+    // The concrete block calls `Attach()` once its object exists, so a throwing constructor
+    // leaves the queue alone
+    BiasedControlBlockBase() : queue(BiasedQueue::ForCurrentThread()) {
+        counts.store(kCustomCount | kWeakOne, std::memory_order_relaxed);
+    }
+    void Attach() {
+        queue->AddRef();
+    }
+
+    static int64_t Count(uint64_t word) {
+        return static_cast<int64_t>(word & kCountMask) - static_cast<int64_t>(kZero);
+    }
+
+    bool IsBiasedOwner() const {
+        // `biased` belongs to the owner, so check the thread first
+        return queue == BiasedQueue::Current() && biased;
+    }
+
+    // Folds the local count into the shared one. Runs on the owner thread, or on any thread once
+    // the owner has exited. Returns true if no references are left
+    bool Merge() {
+        biased = false;
+        uint64_t delta = local_cnt.load(std::memory_order_relaxed) + kMerged;
+        uint64_t word = shared_cnt.fetch_add(delta, std::memory_order_acq_rel) + delta;
+        queue->Release();
+        return Count(word) == 0;
+    }
+
+    // Hands the block to its owner; returns true if the owner has exited and the merge done
+    // here released the last reference
+    bool Enqueue() {
+        AddWeak<AtomicRefCount>();
+        BiasedControlBlockBase* head = queue->head.load(std::memory_order_relaxed);
+        while (head != BiasedQueue::Closed()) {
+            next = head;
+            if (queue->head.compare_exchange_weak(head, this, std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+                return false;
+            }
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        bool dead = Merge();
+        ReleaseWeak<AtomicRefCount>();
+        return dead;
+    }
+
+    void AddStrongCustom(size_t cnt) {
+        if (IsBiasedOwner()) {
+            local_cnt.store(local_cnt.load(std::memory_order_relaxed) + cnt,
+                            std::memory_order_relaxed);
+            return;
+        }
+        shared_cnt.fetch_add(cnt, std::memory_order_relaxed);
+    }
+    bool TryAddStrongCustom() {
+        if (IsBiasedOwner()) {
+            // The owner merges as soon as its local count reaches zero
+            AddStrongCustom(1);
+            return true;
+        }
+        uint64_t word = shared_cnt.load(std::memory_order_relaxed);
+        while (!(word & kMerged) || Count(word) != 0) {
+            if (shared_cnt.compare_exchange_weak(word, word + 1, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    bool ReleaseStrongCustom(size_t cnt) {
+        if (IsBiasedOwner()) {
+            size_t local = local_cnt.load(std::memory_order_relaxed) - cnt;
+            local_cnt.store(local, std::memory_order_relaxed);
+            return local == 0 && Merge();
+        }
+        uint64_t word = shared_cnt.fetch_sub(cnt, std::memory_order_acq_rel) - cnt;
+        if (word & kMerged) {
+            return Count(word) == 0;
+        }
+        if (Count(word) < 0 && !(word & kQueued)) {
+            uint64_t old = shared_cnt.fetch_or(kQueued, std::memory_order_relaxed);
+            if (!(old & (kQueued | kMerged))) {
+                return Enqueue();
+            }
+        }
+        return false;
+    }
+    size_t StrongCountCustom() const {
+        uint64_t word = shared_cnt.load(std::memory_order_relaxed);
+        int64_t cnt = Count(word);
+        if (!(word & kMerged)) {
+            cnt += local_cnt.load(std::memory_order_relaxed);
+        }
+        return cnt > 0 ? cnt : 0;
+    }
+
+    uintptr_t CustomCount(ControlBlockOp op, uintptr_t arg) {
+        switch (op) {
+            case ControlBlockOp::kAddStrong:
+                AddStrongCustom(arg);
+                return 0;
+            case ControlBlockOp::kTryAddStrong:
+                return TryAddStrongCustom();
+            case ControlBlockOp::kReleaseStrong:
+                return ReleaseStrongCustom(arg);
+            case ControlBlockOp::kStrongCount:
+                return StrongCountCustom();
+            default:
+                return 0;
+        }
+    }
+
+    BiasedQueue* queue;
+    // Only written by the owner thread; atomic so that `UseCount()` may peek at it
+    std::atomic<size_t> local_cnt{1};
+    std::atomic<uint64_t> shared_cnt{kZero};
+    BiasedControlBlockBase* next = nullptr;
+    bool biased = true;
+};
+
+template <typename T>
+struct BiasedControlBlock : public ControlBlockInline<T, BiasedControlBlockBase> {
+    template <typename... Args>
+    BiasedControlBlock(Args&&... args) {
+        this->manager = &ManageControlBlock<BiasedControlBlock>;
+        this->Emplace(std::forward<Args>(args)...);
+        this->Attach();
+        SW_PTR_BLOCK_CREATED(T);
+    }
+
+    void Deallocate() {
+        delete this;
+    }
+};
+
+// Merges the blocks that other threads queued up for the calling thread
+inline void MergeBiasedRefCounts() {
+    if (BiasedQueue* queue = BiasedQueue::Current()) {
+        queue->Drain(nullptr);
+    }
+}
+
+inline void BiasedQueue::Drain(BiasedControlBlockBase* replacement) {
+    BiasedControlBlockBase* block = head.exchange(replacement, std::memory_order_acq_rel);
+    while (block != nullptr) {
+        BiasedControlBlockBase* next = block->next;
+        if (block->biased && block->Merge()) {
+            block->ReleaseObject<AtomicRefCount>(block->counts.load(std::memory_order_relaxed));
+        }
+        block->ReleaseWeak<AtomicRefCount>();
+        block = next;
+    }
+}
+
+inline BiasedQueue* BiasedQueue::ForCurrentThread() {
+    struct Owner {
+        ~Owner() {
+            // Blocks queued from now on are merged by the thread that queues them
+            queue->Drain(Closed());
+            Current() = nullptr;
+            queue->Release();
+        }
+
+        BiasedQueue* queue = new BiasedQueue;
+    };
+    thread_local Owner owner;
+    Current() = owner.queue;
+    return owner.queue;
+}
+
+template <typename T, typename... Args>
+SharedPtr<T, AtomicRefCount> MakeSharedBiased(Args&&... args) {
+    MergeBiasedRefCounts();
+    auto block = new BiasedControlBlock<T>(std::forward<Args>(args)...);
+    SharedPtr<T, AtomicRefCount> result(block->GetRawPtr(), block);
+    result.ESFT();
+    return result;
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include "shared.h"
+
+#include <cstddef>  // std::nullptr_t
+#include <exception>
+#include <type_traits>
+#include <utility>
+
+// Single-pointer handles.
+//
+// `CompactSharedPtr` and `CompactWeakPtr` store only the control block and find the object at
+// its fixed offset inside `ControlBlockEmplace<T>`. They can only refer to whole objects created
+// by `MakeShared<T>` (or `MakeCompactShared<T>`) of exactly `T`: aliased, derived or separately
+// allocated objects are rejected when converting from `SharedPtr`.
+
+class BadCompactPtr : public std::exception {};
+
+template <typename T, typename Policy = NonAtomicRefCount>
+class CompactWeakPtr;
+
+template <typename T, typename Policy = NonAtomicRefCount>
+class CompactSharedPtr {
+    using Block = ControlBlockEmplace<std::remove_cv_t<T>>;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    CompactSharedPtr() : block_(nullptr) {
+    }
+    CompactSharedPtr(std::nullptr_t) : block_(nullptr) {
+    }
+
+    CompactSharedPtr(const CompactSharedPtr& other) : block_(other.block_) {
+        if (block_) {
+            block_->template AddStrong<Policy>();
+        }
+    }
+    CompactSharedPtr(CompactSharedPtr&& other) noexcept : block_(other.block_) {
+        other.block_ = nullptr;
+    }
+
+    // Throws `BadCompactPtr` unless `CanCompact(other)`
+    explicit CompactSharedPtr(const SharedPtr<T, Policy>& other) : block_(Check(other)) {
+        if (block_) {
+            block_->template AddStrong<Policy>();
+        }
+    }
+
+    // Adopts a reference that the caller already holds on `block`
+    explicit CompactSharedPtr(Block* block) : block_(block) {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    CompactSharedPtr& operator=(const CompactSharedPtr& other) {
+        CompactSharedPtr(other).Swap(*this);
+        return *this;
+    }
+    CompactSharedPtr& operator=(CompactSharedPtr&& other) noexcept {
+        CompactSharedPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~CompactSharedPtr() {
+        if (block_) {
+            block_->template ReleaseStrong<Policy>();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        CompactSharedPtr().Swap(*this);
+    }
+    void Swap(CompactSharedPtr& other) noexcept {
+        std::swap(block_, other.block_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    static bool CanCompact(const SharedPtr<T, Policy>& ptr) {
+        ControlBlockBase* block = ptr.GetBlock();
+        return block == nullptr || (block->manager == &ManageControlBlock<Block> &&
+                                    static_cast<Block*>(block)->GetRawPtr() == ptr.Get());
+    }
+
+    Block* GetBlock() const {
+        return block_;
+    }
+    T* Get() const {
+        return block_ ? block_->GetRawPtr() : nullptr;
+    }
+    T& operator*() const {
+        return *block_->GetRawPtr();
+    }
+    T* operator->() const {
+        return block_->GetRawPtr();
+    }
+    size_t UseCount() const {
+        if (block_) {
+            return block_->template StrongCount<Policy>();
+        }
+        return 0;
+    }
+    explicit operator bool() const {
+        return block_ != nullptr;
+    }
+
+    // Widens back to a regular pointer sharing the same object
+    operator SharedPtr<T, Policy>() const& {
+        if (!block_) {
+            return SharedPtr<T, Policy>();
+        }
+        block_->template AddStrong<Policy>();
+        return SharedPtr<T, Policy>(block_->GetRawPtr(), block_);
+    }
+    // Same, handing over the reference
+    operator SharedPtr<T, Policy>() && {
+        if (!block_) {
+            return SharedPtr<T, Policy>();
+        }
+        Block* block = std::exchange(block_, nullptr);
+        return SharedPtr<T, Policy>(block->GetRawPtr(), block);
+    }
+
+private:
+    static Block* Check(const SharedPtr<T, Policy>& ptr) {
+        if (!CanCompact(ptr)) {
+            throw BadCompactPtr();
+        }
+        return static_cast<Block*>(ptr.GetBlock());
+    }
+
+    Block* block_;
+};
+
+template <typename T, typename Policy>
+class CompactWeakPtr {
+    using Block = ControlBlockEmplace<std::remove_cv_t<T>>;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    CompactWeakPtr() : block_(nullptr) {
+    }
+
+    CompactWeakPtr(const CompactWeakPtr& other) : block_(other.block_) {
+        if (block_) {
+            block_->template AddWeak<Policy>();
+        }
+    }
+    CompactWeakPtr(CompactWeakPtr&& other) noexcept : block_(other.block_) {
+        other.block_ = nullptr;
+    }
+
+    // Demote `CompactSharedPtr`
+    CompactWeakPtr(const CompactSharedPtr<T, Policy>& other) : block_(other.GetBlock()) {
+        if (block_) {
+            block_->template AddWeak<Policy>();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    CompactWeakPtr& operator=(const CompactWeakPtr& other) {
+        CompactWeakPtr(other).Swap(*this);
+        return *this;
+    }
+    CompactWeakPtr& operator=(CompactWeakPtr&& other) noexcept {
+        CompactWeakPtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~CompactWeakPtr() {
+        if (block_) {
+            block_->template ReleaseWeak<Policy>();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        CompactWeakPtr().Swap(*this);
+    }
+    void Swap(CompactWeakPtr& other) noexcept {
+        std::swap(block_, other.block_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t UseCount() const {
+        if (block_) {
+            return block_->template StrongCount<Policy>();
+        }
+        return 0;
+    }
+    bool Expired() const {
+        return UseCount() == 0;
+    }
+    CompactSharedPtr<T, Policy> Lock() const {
+        if (block_ && block_->template TryAddStrong<Policy>()) {
+            return CompactSharedPtr<T, Policy>(block_);
+        }
+        return CompactSharedPtr<T, Policy>();
+    }
+
+    Block* GetBlock() const {
+        return block_;
+    }
+
+private:
+    Block* block_;
+};
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<CompactSharedPtr<T, Policy>> : std::true_type {};
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<CompactWeakPtr<T, Policy>> : std::true_type {};
+
+template <typename T, typename P, typename U, typename Q>
+inline bool operator==(const CompactSharedPtr<T, P>& left, const CompactSharedPtr<U, Q>& right) {
+    return left.Get() == right.Get();
+}
+
+// Always uses the single-allocation layout, regardless of `StoreSeparately<T>`
+template <typename T, typename Policy = NonAtomicRefCount, typename... Args>
+CompactSharedPtr<T, Policy> MakeCompactShared(Args&&... args) {
+    auto block = new ControlBlockEmplace<std::remove_cv_t<T>>(std::forward<Args>(args)...);
+    CompactSharedPtr<T, Policy> result(block);
+    if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+        // Borrows the reference of `result` just to set up `EnableSharedFromThis`
+        SharedPtr<T, Policy> owner(block->GetRawPtr(), block);
+        owner.ESFT();
+        owner.Detach();
+    }
+    return result;
+}
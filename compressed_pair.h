@@ -1,5 +1,7 @@
 #pragma once
 
+#include "relocation.h"
+
 #include <type_traits>
 #include <stddef.h>
 #include <utility>
@@ -72,3 +74,7 @@ public:
         return Second::GetElement();
     };
 };
+
+template <typename F, typename S>
+struct IsTriviallyRelocatable<CompressedPair<F, S>>
+    : std::bool_constant<IsTriviallyRelocatable<F>::value && IsTriviallyRelocatable<S>::value> {};
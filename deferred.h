@@ -0,0 +1,249 @@
+#pragma once
+
+#include "shared.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <utility>
+
+// Deferred destruction.
+//
+// Releasing the last reference to a large object graph runs every destructor on the releasing
+// thread. Blocks created with `MakeShared<T>(kDeferDestroy, ...)`, and every block whose last
+// reference is dropped inside a `DeferredDestructionScope`, are instead pushed onto a lock-free
+// queue and destroyed in batches by a background thread. Only thread-safe counting policies are
+// deferred, since the reclaimer thread also releases everything the object owns.
+
+struct DeferredReclaimStats {
+    // Blocks waiting to be destroyed
+    size_t queue_depth;
+    uint64_t enqueued;
+    uint64_t reclaimed;
+    uint64_t batches;
+    // Time spent destroying one batch
+    uint64_t max_drain_ns;
+    uint64_t total_drain_ns;
+};
+
+class DeferredReclaimer {
+    struct Node {
+        ControlBlockBase* block;
+        bool exclusive;
+        Node* next;
+    };
+
+public:
+    static DeferredReclaimer& Instance() {
+        static DeferredReclaimer reclaimer;
+        return reclaimer;
+    }
+
+    DeferredReclaimer(const DeferredReclaimer& other) = delete;
+    DeferredReclaimer& operator=(const DeferredReclaimer& other) = delete;
+
+    // Releases whatever is still queued: nothing may be deferred after static destruction began
+    ~DeferredReclaimer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        Drain();
+    }
+
+    // Takes over the last strong reference of `block` (and the implicit weak one unless
+    // `exclusive`). Returns false if the block has to be released inline
+    bool Defer(ControlBlockBase* block, bool exclusive) {
+        if (Draining()) {
+            return false;
+        }
+        auto node = new (std::nothrow) Node{block, exclusive, nullptr};
+        if (node == nullptr) {
+            return false;
+        }
+        enqueued_.fetch_add(1, std::memory_order_relaxed);
+        // `node` belongs to the reclaimer as soon as it is pushed
+        Node* head = head_.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!head_.compare_exchange_weak(head, node, std::memory_order_release,
+                                              std::memory_order_relaxed));
+        if (head == nullptr) {
+            // The reclaimer may be asleep; it rechecks the queue under the mutex
+            std::lock_guard<std::mutex> lock(mutex_);
+            wake_.notify_one();
+        }
+        return true;
+    }
+
+    // Destroys everything queued so far on the calling thread
+    void Drain() {
+        Node* list = head_.exchange(nullptr, std::memory_order_acquire);
+        if (list == nullptr) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        // Objects released by the destructors below are destroyed right away
+        bool& draining = Draining();
+        bool was_draining = std::exchange(draining, true);
+        // Oldest first
+        Node* reversed = nullptr;
+        while (list != nullptr) {
+            Node* node = std::exchange(list, list->next);
+            node->next = reversed;
+            reversed = node;
+        }
+        uint64_t cnt = 0;
+        while (reversed != nullptr) {
+            Node* node = std::exchange(reversed, reversed->next);
+            if (node->exclusive) {
+                node->block->Dispatch(ControlBlockOp::kDestroyAndDeallocate);
+            } else {
+                node->block->Dispatch(ControlBlockOp::kDestroy);
+                node->block->ReleaseWeak<AtomicRefCount>();
+            }
+            delete node;
+            ++cnt;
+        }
+        draining = was_draining;
+
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+        reclaimed_.fetch_add(cnt, std::memory_order_relaxed);
+        batches_.fetch_add(1, std::memory_order_relaxed);
+        total_drain_ns_.fetch_add(elapsed, std::memory_order_relaxed);
+        uint64_t max = max_drain_ns_.load(std::memory_order_relaxed);
+        while (elapsed > max && !max_drain_ns_.compare_exchange_weak(max, elapsed,
+                                                                     std::memory_order_relaxed)) {
+        }
+    }
+
+    DeferredReclaimStats Stats() const {
+        uint64_t reclaimed = reclaimed_.load(std::memory_order_relaxed);
+        uint64_t enqueued = enqueued_.load(std::memory_order_relaxed);
+        return DeferredReclaimStats{static_cast<size_t>(enqueued - reclaimed),
+                                    enqueued,
+                                    reclaimed,
+                                    batches_.load(std::memory_order_relaxed),
+                                    max_drain_ns_.load(std::memory_order_relaxed),
+                                    total_drain_ns_.load(std::memory_order_relaxed)};
+    }
+
+    // Set while the calling thread destroys deferred blocks
+    static bool& Draining() {
+        thread_local bool draining = false;
+        return draining;
+    }
+
+private:
+    DeferredReclaimer() : thread_([this] { Run(); }) {
+    }
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            wake_.wait(lock, [this] {
+                return stop_ || head_.load(std::memory_order_relaxed) != nullptr;
+            });
+            if (stop_) {
+                return;
+            }
+            lock.unlock();
+            Drain();
+            lock.lock();
+        }
+    }
+
+    std::atomic<Node*> head_{nullptr};
+    std::atomic<uint64_t> enqueued_{0};
+    std::atomic<uint64_t> reclaimed_{0};
+    std::atomic<uint64_t> batches_{0};
+    std::atomic<uint64_t> max_drain_ns_{0};
+    std::atomic<uint64_t> total_drain_ns_{0};
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// Defers the destruction of every thread-safe block released on this thread while alive
+class DeferredDestructionScope {
+public:
+    DeferredDestructionScope() : previous_(CurrentDeferredReleaseHook()) {
+        // Start the reclaimer before the first release needs it
+        DeferredReclaimer::Instance();
+        CurrentDeferredReleaseHook() = &Defer;
+    }
+
+    DeferredDestructionScope(const DeferredDestructionScope& other) = delete;
+    DeferredDestructionScope& operator=(const DeferredDestructionScope& other) = delete;
+
+    ~DeferredDestructionScope() {
+        CurrentDeferredReleaseHook() = previous_;
+    }
+
+private:
+    static bool Defer(ControlBlockBase* block, bool exclusive) {
+        return DeferredReclaimer::Instance().Defer(block, exclusive);
+    }
+
+    DeferredReleaseHook previous_;
+};
+
+// Intercepts the destruction of `Block` and hands it to the reclaimer
+template <typename Block>
+uintptr_t ManageDeferredControlBlock(ControlBlockBase* base, ControlBlockOp op, uintptr_t arg) {
+    switch (op) {
+        case ControlBlockOp::kDestroy:
+            if (DeferredReclaimer::Draining()) {
+                break;
+            }
+            // The reclaimer keeps the block alive until the object is destroyed
+            base->AddWeak<AtomicRefCount>();
+            if (DeferredReclaimer::Instance().Defer(base, false)) {
+                return 0;
+            }
+            base->ReleaseWeak<AtomicRefCount>();
+            break;
+        case ControlBlockOp::kDestroyAndDeallocate:
+            if (DeferredReclaimer::Instance().Defer(base, true)) {
+                return 0;
+            }
+            break;
+        default:
+            break;
+    }
+    return ManageControlBlock<Block>(base, op, arg);
+}
+
+template <typename T>
+struct ControlBlockDeferred : public ControlBlockEmplace<T> {
+    template <typename... Args>
+    ControlBlockDeferred(Args&&... args) : ControlBlockEmplace<T>(std::forward<Args>(args)...) {
+        this->manager = &ManageDeferredControlBlock<ControlBlockDeferred>;
+    }
+
+    void Deallocate() {
+        delete this;
+    }
+};
+
+struct DeferDestroyTag {};
+inline constexpr DeferDestroyTag kDeferDestroy{};
+
+template <typename T, typename Policy = AtomicRefCount, typename... Args>
+SharedPtr<T, Policy> MakeShared(DeferDestroyTag, Args&&... args) {
+    static_assert(Policy::kThreadSafe, "Deferred objects are destroyed on another thread");
+    DeferredReclaimer::Instance();
+    auto block = new ControlBlockDeferred<T>(std::forward<Args>(args)...);
+    SharedPtr<T, Policy> result(block->GetRawPtr(), block);
+    result.ESFT();
+    return result;
+}
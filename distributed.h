@@ -0,0 +1,181 @@
+#pragma once
+
+#include "shared.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// Distributed reference counting.
+//
+// A distributed block splits its strong count into a central count and one cache line per
+// shard; threads are spread over the shards. A copy adds to the calling thread's shard, a
+// release takes from it as long as the shard holds enough, so threads that copy and drop a hot
+// pointer never touch a line another thread writes. Releases that find their shard empty go to
+// the central count. Only when that reaches zero, and for `UseCount()` or `WeakPtr::Lock()`, all
+// shards are folded into the central count under the block's mutex. The shards are frozen
+// meanwhile, every update then goes to the central count. The total is exact at that moment, so
+// the object is destroyed as soon as it reaches zero.
+
+struct DistributedControlBlockBase : public ControlBlockBase {
+    // Set in a shard while it is folded
+    static constexpr uint64_t kFrozen = uint64_t{1} << 63;
+    static constexpr size_t kMaxShards = 64;
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> cnt{0};
+    };
+
+    DistributedControlBlockBase() : shards(new Shard[ShardCount()]) {
+        counts.store(kCustomCount | kWeakOne, std::memory_order_relaxed);
+    }
+
+    // Hardware threads rounded up to a power of two
+    static size_t ShardCount() {
+        static const size_t count = [] {
+            size_t cpus = std::thread::hardware_concurrency();
+            size_t shards = 1;
+            while (shards < cpus && shards < kMaxShards) {
+                shards *= 2;
+            }
+            return shards;
+        }();
+        return count;
+    }
+    static size_t ThreadIndex() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+    std::atomic<uint64_t>& LocalShard() {
+        return shards[ThreadIndex() & (ShardCount() - 1)].cnt;
+    }
+
+    // Moves every shard into `central` and returns the total. The shards stay frozen until
+    // `Thaw()`; called with `mutex` held
+    int64_t Fold() {
+        int64_t sum = 0;
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            sum += shards[i].cnt.exchange(kFrozen, std::memory_order_acq_rel);
+        }
+        return central.fetch_add(sum, std::memory_order_acq_rel) + sum;
+    }
+    void Thaw() {
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            shards[i].cnt.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void AddStrongCustom(size_t cnt) {
+        std::atomic<uint64_t>& shard = LocalShard();
+        uint64_t word = shard.load(std::memory_order_relaxed);
+        while (!(word & kFrozen)) {
+            if (shard.compare_exchange_weak(word, word + cnt, std::memory_order_relaxed,
+                                            std::memory_order_relaxed)) {
+                return;
+            }
+        }
+        central.fetch_add(cnt, std::memory_order_relaxed);
+    }
+    bool TryAddStrongCustom() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (dead) {
+            return false;
+        }
+        Fold();
+        // Others keep releasing into `central` while the shards are frozen
+        int64_t cnt = central.load(std::memory_order_relaxed);
+        bool added = false;
+        while (cnt > 0 && !added) {
+            added = central.compare_exchange_weak(cnt, cnt + 1, std::memory_order_relaxed,
+                                                  std::memory_order_relaxed);
+        }
+        Thaw();
+        return added;
+    }
+    // Shards never go below zero, so the total can only reach zero through `central`
+    bool ReleaseStrongCustom(size_t cnt) {
+        std::atomic<uint64_t>& shard = LocalShard();
+        uint64_t word = shard.load(std::memory_order_relaxed);
+        while (!(word & kFrozen) && word >= cnt) {
+            if (shard.compare_exchange_weak(word, word - cnt, std::memory_order_release,
+                                            std::memory_order_relaxed)) {
+                return false;
+            }
+        }
+        if (central.fetch_sub(cnt, std::memory_order_acq_rel) > static_cast<int64_t>(cnt)) {
+            return false;
+        }
+        // Several releases may be waiting here when the total reaches zero, the first one to
+        // see it destroys the object
+        std::lock_guard<std::mutex> lock(mutex);
+        if (dead) {
+            return false;
+        }
+        if (Fold() == 0) {
+            dead = true;
+            return true;
+        }
+        Thaw();
+        return false;
+    }
+    size_t StrongCountCustom() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (dead) {
+            return 0;
+        }
+        int64_t cnt = Fold();
+        Thaw();
+        return cnt > 0 ? cnt : 0;
+    }
+
+    uintptr_t CustomCount(ControlBlockOp op, uintptr_t arg) {
+        switch (op) {
+            case ControlBlockOp::kAddStrong:
+                AddStrongCustom(arg);
+                return 0;
+            case ControlBlockOp::kTryAddStrong:
+                return TryAddStrongCustom();
+            case ControlBlockOp::kReleaseStrong:
+                return ReleaseStrongCustom(arg);
+            case ControlBlockOp::kStrongCount:
+                return StrongCountCustom();
+            default:
+                return 0;
+        }
+    }
+
+    std::unique_ptr<Shard[]> shards;
+    // May be negative while shards hold the references it lacks
+    std::atomic<int64_t> central{1};
+    std::mutex mutex;
+    bool dead = false;
+};
+
+template <typename T>
+struct DistributedControlBlock : public ControlBlockInline<T, DistributedControlBlockBase> {
+    template <typename... Args>
+    DistributedControlBlock(Args&&... args) {
+        this->manager = &ManageControlBlock<DistributedControlBlock>;
+        this->Emplace(std::forward<Args>(args)...);
+        SW_PTR_BLOCK_CREATED(T);
+    }
+
+    void Deallocate() {
+        delete this;
+    }
+};
+
+// For the few objects that every thread copies all the time: a block takes a cache line per
+// shard, and `UseCount()` and `WeakPtr::Lock()` lock it
+template <typename T, typename... Args>
+SharedPtr<T, AtomicRefCount> MakeSharedDistributed(Args&&... args) {
+    auto block = new DistributedControlBlock<T>(std::forward<Args>(args)...);
+    SharedPtr<T, AtomicRefCount> result(block->GetRawPtr(), block);
+    result.ESFT();
+    return result;
+}
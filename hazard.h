@@ -0,0 +1,248 @@
+#pragma once
+
+#include "lifetime.h"
+#include "shared.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Hazard pointer reclamation.
+//
+// A reader publishes the address of a control block in a hazard record before using the object,
+// so short reads don't touch the reference count at all. Writers hand replaced blocks to
+// `Retire` together with one strong reference; the reference is dropped, through the usual
+// `ReleaseStrong` / `kDestroy` path, once no hazard record points to the block. Retired blocks
+// are scanned in batches whose size grows with the number of records.
+
+struct HazardRecord {
+    std::atomic<const void*> ptr{nullptr};
+    std::atomic<bool> active{true};
+    HazardRecord* next = nullptr;
+};
+
+class HazardDomain {
+    // Blocks retired on top of twice the number of records before a scan is started
+    static constexpr size_t kMinRetired = 64;
+
+    struct Retired {
+        ControlBlockBase* block;
+        Retired* next;
+    };
+
+public:
+    HazardDomain() = default;
+
+    HazardDomain(const HazardDomain& other) = delete;
+    HazardDomain& operator=(const HazardDomain& other) = delete;
+
+    // No reader may be left when the domain dies
+    ~HazardDomain() {
+        ReleaseAll(retired_.exchange(nullptr, std::memory_order_acquire));
+        HazardRecord* record = records_.load(std::memory_order_acquire);
+        while (record != nullptr) {
+            delete std::exchange(record, record->next);
+        }
+    }
+
+    // Never destroyed, so static slots may still retire into it during static destruction
+    static HazardDomain& Default() {
+        return NeverDestroyed<HazardDomain>();
+    }
+
+    // Records are never freed before the domain, inactive ones are reused
+    HazardRecord* AcquireRecord() {
+        for (HazardRecord* record = records_.load(std::memory_order_acquire); record != nullptr;
+             record = record->next) {
+            bool active = false;
+            if (!record->active.load(std::memory_order_relaxed) &&
+                record->active.compare_exchange_strong(active, true, std::memory_order_acquire,
+                                                       std::memory_order_relaxed)) {
+                return record;
+            }
+        }
+        auto record = new HazardRecord;
+        record->next = records_.load(std::memory_order_relaxed);
+        while (!records_.compare_exchange_weak(record->next, record, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+        }
+        record_cnt_.fetch_add(1, std::memory_order_relaxed);
+        return record;
+    }
+    void ReleaseRecord(HazardRecord* record) {
+        record->ptr.store(nullptr, std::memory_order_release);
+        record->active.store(false, std::memory_order_release);
+    }
+
+    // Takes over one strong reference to `block`
+    void Retire(ControlBlockBase* block) {
+        auto node = new Retired{block, nullptr};
+        Push(node, node, 1);
+        size_t threshold = 2 * record_cnt_.load(std::memory_order_relaxed) + kMinRetired;
+        if (retired_cnt_.load(std::memory_order_relaxed) >= threshold) {
+            Reclaim();
+        }
+    }
+
+    // Releases every retired block that is not protected right now
+    void Reclaim() {
+        Retired* list = retired_.exchange(nullptr, std::memory_order_acquire);
+        if (list == nullptr) {
+            return;
+        }
+        // Pairs with the fence in `HazardPointer::Protect`: either the reader sees the block
+        // replaced, or we see its hazard
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::vector<const void*> hazards;
+        for (HazardRecord* record = records_.load(std::memory_order_acquire); record != nullptr;
+             record = record->next) {
+            if (const void* ptr = record->ptr.load(std::memory_order_acquire)) {
+                hazards.push_back(ptr);
+            }
+        }
+        std::sort(hazards.begin(), hazards.end());
+
+        Retired* kept_head = nullptr;
+        Retired* kept_tail = nullptr;
+        size_t taken = 0;
+        size_t kept = 0;
+        while (list != nullptr) {
+            Retired* node = std::exchange(list, list->next);
+            ++taken;
+            if (std::binary_search(hazards.begin(), hazards.end(), node->block)) {
+                node->next = kept_head;
+                kept_head = node;
+                kept_tail = kept_tail ? kept_tail : node;
+                ++kept;
+                continue;
+            }
+            node->block->ReleaseStrong<AtomicRefCount>();
+            delete node;
+        }
+        retired_cnt_.fetch_sub(taken, std::memory_order_relaxed);
+        if (kept_head != nullptr) {
+            Push(kept_head, kept_tail, kept);
+        }
+    }
+
+private:
+    void Push(Retired* head, Retired* tail, size_t cnt) {
+        retired_cnt_.fetch_add(cnt, std::memory_order_relaxed);
+        tail->next = retired_.load(std::memory_order_relaxed);
+        while (!retired_.compare_exchange_weak(tail->next, head, std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+        }
+    }
+
+    static void ReleaseAll(Retired* list) {
+        while (list != nullptr) {
+            Retired* node = std::exchange(list, list->next);
+            node->block->ReleaseStrong<AtomicRefCount>();
+            delete node;
+        }
+    }
+
+    std::atomic<HazardRecord*> records_{nullptr};
+    std::atomic<size_t> record_cnt_{0};
+    std::atomic<Retired*> retired_{nullptr};
+    std::atomic<size_t> retired_cnt_{0};
+};
+
+// Owns one hazard record for its lifetime
+class HazardPointer {
+public:
+    explicit HazardPointer(HazardDomain& domain = HazardDomain::Default())
+        : domain_(&domain), record_(domain.AcquireRecord()) {
+    }
+
+    HazardPointer(const HazardPointer& other) = delete;
+    HazardPointer& operator=(const HazardPointer& other) = delete;
+
+    ~HazardPointer() {
+        domain_->ReleaseRecord(record_);
+    }
+
+    // Loads `src` and keeps the result from being reclaimed until the next `Protect` or `Reset`
+    template <typename P>
+    P* Protect(const std::atomic<P*>& src) {
+        P* ptr = src.load(std::memory_order_relaxed);
+        while (true) {
+            record_->ptr.store(ptr, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            P* current = src.load(std::memory_order_acquire);
+            if (current == ptr) {
+                return ptr;
+            }
+            ptr = current;
+        }
+    }
+    void Reset() {
+        record_->ptr.store(nullptr, std::memory_order_release);
+    }
+
+private:
+    HazardDomain* domain_;
+    HazardRecord* record_;
+};
+
+// Slot holding a `SharedPtr` that readers may look at through a `HazardPointer` without
+// touching any reference count. Replaced values are retired to the domain.
+template <typename T>
+class HazardSharedPtr {
+    using Value = SharedPtr<T, AtomicRefCount>;
+    using Entry = ControlBlockEmplace<Value>;
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    explicit HazardSharedPtr(HazardDomain& domain = HazardDomain::Default())
+        : domain_(&domain), entry_(nullptr) {
+    }
+    explicit HazardSharedPtr(Value value, HazardDomain& domain = HazardDomain::Default())
+        : domain_(&domain), entry_(MakeEntry(std::move(value))) {
+    }
+
+    HazardSharedPtr(const HazardSharedPtr& other) = delete;
+    HazardSharedPtr& operator=(const HazardSharedPtr& other) = delete;
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~HazardSharedPtr() {
+        if (Entry* entry = entry_.load(std::memory_order_relaxed)) {
+            domain_->Retire(entry);
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Operations
+
+    void Store(Value value) {
+        Entry* old = entry_.exchange(MakeEntry(std::move(value)), std::memory_order_acq_rel);
+        if (old != nullptr) {
+            domain_->Retire(old);
+        }
+    }
+    // Pointer to the current object, valid while `hp` protects it
+    T* Protect(HazardPointer& hp) const {
+        Entry* entry = hp.Protect(entry_);
+        return entry ? entry->GetRawPtr()->Get() : nullptr;
+    }
+    // Full reference, for values that outlive the read
+    Value Load() const {
+        HazardPointer hp(*domain_);
+        Entry* entry = hp.Protect(entry_);
+        return entry ? *entry->GetRawPtr() : Value();
+    }
+
+private:
+    static Entry* MakeEntry(Value value) {
+        return value ? new Entry(std::move(value)) : nullptr;
+    }
+
+    HazardDomain* domain_;
+    std::atomic<Entry*> entry_;
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "lifetime.h"
+
+#include <cstddef>
+#include <string>
+
+// Extracts `T` from the signature of `TypeName<T>()`
+inline std::string ParseTypeName(const std::string& signature) {
+    size_t begin = signature.find("T = ");
+    if (begin == std::string::npos) {
+        return signature;
+    }
+    begin += 4;
+    // GCC lists other aliases after `;`, the signature ends with `]`
+    size_t end = signature.find(';', begin);
+    if (end == std::string::npos) {
+        end = signature.rfind(']');
+    }
+    return signature.substr(begin, end - begin);
+}
+
+// Readable name of `T` without RTTI
+template <typename T>
+const std::string& TypeName() {
+    static const std::string name = ParseTypeName(__PRETTY_FUNCTION__);
+    return name;
+}
+
+// Per-type counters of allocations and reference count traffic.
+//
+// Compiled in only when `SW_PTR_INSTRUMENTATION` is defined, identically in every translation
+// unit since it changes the layout of `ControlBlockBase`. Otherwise the hooks below expand to
+// nothing. Events are counted in thread-local buffers without locked instructions and summed up
+// by `CollectInstrumentation()`; only the live object count of a type is shared between threads.
+
+#ifdef SW_PTR_INSTRUMENTATION
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+enum class InstrumentEvent {
+    kAllocate,
+    kDestroy,
+    kStrongIncrement,
+    kStrongDecrement,
+    kWeakIncrement,
+    kWeakDecrement,
+    kCount,
+};
+
+constexpr size_t kInstrumentEventCount = static_cast<size_t>(InstrumentEvent::kCount);
+
+struct TypeStats {
+    template <typename T>
+    static TypeStats& For();
+
+    std::string name;
+    size_t size;
+    // Slot in the thread buffers
+    size_t index;
+    std::atomic<int64_t> live{0};
+    std::atomic<int64_t> peak_live{0};
+    // Control blocks whose object is destroyed but which are kept by weak references
+    std::atomic<int64_t> weak_only_bytes{0};
+};
+
+struct TypeReport {
+    std::string name;
+    size_t size;
+    uint64_t allocations;
+    uint64_t destructions;
+    uint64_t strong_increments;
+    uint64_t strong_decrements;
+    uint64_t weak_increments;
+    uint64_t weak_decrements;
+    int64_t live;
+    int64_t peak_live;
+    int64_t weak_only_bytes;
+};
+
+class InstrumentRegistry {
+public:
+    using Counters = std::array<uint64_t, kInstrumentEventCount>;
+
+    // Counters of one thread. Written only by the owner, read by `Collect`
+    class Buffer {
+        static constexpr size_t kChunkSize = 64;
+        static constexpr size_t kMaxChunks = 1024;
+        using Chunk = std::array<std::atomic<uint64_t>, kChunkSize * kInstrumentEventCount>;
+
+    public:
+        Buffer() {
+            InstrumentRegistry::Instance().Attach(this);
+        }
+        ~Buffer() {
+            InstrumentRegistry::Instance().Detach(this);
+            for (auto& chunk : chunks_) {
+                delete chunk.load(std::memory_order_relaxed);
+            }
+        }
+
+        void Add(size_t index, InstrumentEvent event, uint64_t cnt) {
+            Chunk* chunk = chunks_[index / kChunkSize].load(std::memory_order_relaxed);
+            if (chunk == nullptr) {
+                chunk = new Chunk{};
+                chunks_[index / kChunkSize].store(chunk, std::memory_order_release);
+            }
+            auto& counter =
+                (*chunk)[index % kChunkSize * kInstrumentEventCount + static_cast<size_t>(event)];
+            counter.store(counter.load(std::memory_order_relaxed) + cnt,
+                          std::memory_order_relaxed);
+        }
+        void AddTo(std::vector<Counters>& totals) const {
+            for (size_t index = 0; index < totals.size(); ++index) {
+                Chunk* chunk = chunks_[index / kChunkSize].load(std::memory_order_acquire);
+                if (chunk == nullptr) {
+                    continue;
+                }
+                for (size_t event = 0; event < kInstrumentEventCount; ++event) {
+                    totals[index][event] +=
+                        (*chunk)[index % kChunkSize * kInstrumentEventCount + event].load(
+                            std::memory_order_relaxed);
+                }
+            }
+        }
+
+    private:
+        std::array<std::atomic<Chunk*>, kMaxChunks> chunks_{};
+    };
+
+    static InstrumentRegistry& Instance() {
+        return NeverDestroyed<InstrumentRegistry>();
+    }
+
+    // Null once the thread is shutting down; later events are dropped
+    static Buffer* CurrentBuffer() {
+        return ThreadLocalInstance<Buffer>::Get();
+    }
+
+    TypeStats* Register(std::string name, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto stats = std::make_unique<TypeStats>();
+        stats->name = std::move(name);
+        stats->size = size;
+        stats->index = types_.size();
+        types_.push_back(std::move(stats));
+        return types_.back().get();
+    }
+
+    std::vector<TypeReport> Collect() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<Counters> totals = exited_;
+        totals.resize(types_.size(), Counters{});
+        for (const Buffer* buffer : buffers_) {
+            buffer->AddTo(totals);
+        }
+        std::vector<TypeReport> reports;
+        for (size_t index = 0; index < types_.size(); ++index) {
+            const TypeStats& stats = *types_[index];
+            const Counters& cnt = totals[index];
+            reports.push_back(TypeReport{
+                stats.name,
+                stats.size,
+                cnt[static_cast<size_t>(InstrumentEvent::kAllocate)],
+                cnt[static_cast<size_t>(InstrumentEvent::kDestroy)],
+                cnt[static_cast<size_t>(InstrumentEvent::kStrongIncrement)],
+                cnt[static_cast<size_t>(InstrumentEvent::kStrongDecrement)],
+                cnt[static_cast<size_t>(InstrumentEvent::kWeakIncrement)],
+                cnt[static_cast<size_t>(InstrumentEvent::kWeakDecrement)],
+                stats.live.load(std::memory_order_relaxed),
+                stats.peak_live.load(std::memory_order_relaxed),
+                stats.weak_only_bytes.load(std::memory_order_relaxed),
+            });
+        }
+        return reports;
+    }
+
+private:
+    friend InstrumentRegistry& NeverDestroyed<InstrumentRegistry>();
+
+    InstrumentRegistry() = default;
+
+    void Attach(Buffer* buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        buffers_.push_back(buffer);
+    }
+    // Counts of exited threads are kept
+    void Detach(Buffer* buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        exited_.resize(types_.size(), Counters{});
+        buffer->AddTo(exited_);
+        buffers_.erase(std::find(buffers_.begin(), buffers_.end(), buffer));
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<TypeStats>> types_;
+    std::vector<Buffer*> buffers_;
+    std::vector<Counters> exited_;
+};
+
+template <typename T>
+TypeStats& TypeStats::For() {
+    // Arrays are reported by the size of one element
+    static TypeStats* stats =
+        InstrumentRegistry::Instance().Register(TypeName<T>(), sizeof(std::remove_extent_t<T>));
+    return *stats;
+}
+
+inline void RecordInstrumentEvent(TypeStats* stats, InstrumentEvent event, uint64_t cnt) {
+    if (stats == nullptr) {
+        return;
+    }
+    if (auto buffer = InstrumentRegistry::CurrentBuffer()) {
+        buffer->Add(stats->index, event, cnt);
+    }
+    if (event == InstrumentEvent::kAllocate) {
+        int64_t live = stats->live.fetch_add(1, std::memory_order_relaxed) + 1;
+        int64_t peak = stats->peak_live.load(std::memory_order_relaxed);
+        while (live > peak &&
+               !stats->peak_live.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+        }
+    } else if (event == InstrumentEvent::kDestroy) {
+        stats->live.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+inline std::vector<TypeReport> CollectInstrumentation() {
+    return InstrumentRegistry::Instance().Collect();
+}
+
+// One line per type, most allocated first
+inline void DumpInstrumentation(std::FILE* out = stderr) {
+    std::vector<TypeReport> reports = CollectInstrumentation();
+    std::sort(reports.begin(), reports.end(), [](const TypeReport& lhs, const TypeReport& rhs) {
+        return lhs.allocations > rhs.allocations;
+    });
+    for (const TypeReport& report : reports) {
+        std::fprintf(out,
+                     "%s (%zu bytes): allocations %llu, live %lld, peak %lld, strong +%llu/-%llu, "
+                     "weak +%llu/-%llu, weak-only bytes %lld\n",
+                     report.name.c_str(), report.size,
+                     static_cast<unsigned long long>(report.allocations),
+                     static_cast<long long>(report.live), static_cast<long long>(report.peak_live),
+                     static_cast<unsigned long long>(report.strong_increments),
+                     static_cast<unsigned long long>(report.strong_decrements),
+                     static_cast<unsigned long long>(report.weak_increments),
+                     static_cast<unsigned long long>(report.weak_decrements),
+                     static_cast<long long>(report.weak_only_bytes));
+    }
+}
+
+// Part of `SW_PTR_BLOCK_CREATED` (see sw_fwd.h)
+#define SW_PTR_INSTRUMENT_BLOCK(T)                                                    \
+    do {                                                                              \
+        this->stats = &TypeStats::For<T>();                                           \
+        RecordInstrumentEvent(this->stats, InstrumentEvent::kAllocate, 1);            \
+    } while (false)
+#define SW_PTR_RECORD(stats, event, cnt) RecordInstrumentEvent(stats, InstrumentEvent::event, cnt)
+#define SW_PTR_RECORD_TYPE(T, event) \
+    RecordInstrumentEvent(&TypeStats::For<T>(), InstrumentEvent::event, 1)
+#define SW_PTR_RECORD_WEAK_ONLY(stats, bytes)                                          \
+    do {                                                                               \
+        if (stats) {                                                                   \
+            (stats)->weak_only_bytes.fetch_add(bytes, std::memory_order_relaxed);     \
+        }                                                                              \
+    } while (false)
+
+#else
+
+#define SW_PTR_INSTRUMENT_BLOCK(T) \
+    do {                           \
+    } while (false)
+#define SW_PTR_RECORD(stats, event, cnt) \
+    do {                                 \
+    } while (false)
+#define SW_PTR_RECORD_TYPE(T, event) \
+    do {                             \
+    } while (false)
+#define SW_PTR_RECORD_WEAK_ONLY(stats, bytes) \
+    do {                                      \
+    } while (false)
+
+#endif
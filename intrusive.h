@@ -0,0 +1,160 @@
+#pragma once
+
+#include "ref_count.h"
+#include "relocation.h"
+
+#include <atomic>
+#include <cstddef>  // std::nullptr_t
+#include <utility>
+
+// Base for objects that keep their own reference count, so no control block is needed and
+// `IntrusivePtr` is a single pointer. The object is deleted as `T`, types derived further from
+// `T` need a virtual destructor in `T`
+template <typename T, typename Policy = NonAtomicRefCount>
+class IntrusiveRefCounted {
+public:
+    IntrusiveRefCounted() = default;
+    // References belong to the object, not to its value
+    IntrusiveRefCounted(const IntrusiveRefCounted&) {
+    }
+    IntrusiveRefCounted& operator=(const IntrusiveRefCounted&) {
+        return *this;
+    }
+
+    void IncRef() const {
+        Policy::Add(ref_cnt_, 1);
+    }
+    void DecRef() const {
+        if (Policy::FetchSub(ref_cnt_, 1) == 1) {
+            Policy::AcquireFence();
+            delete static_cast<const T*>(this);
+        }
+    }
+    size_t RefCount() const {
+        return Policy::Load(ref_cnt_);
+    }
+
+protected:
+    ~IntrusiveRefCounted() = default;
+
+private:
+    mutable std::atomic<size_t> ref_cnt_{0};
+};
+
+template <typename T>
+class IntrusivePtr {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    IntrusivePtr() : ptr_(nullptr) {
+    }
+    IntrusivePtr(std::nullptr_t) : ptr_(nullptr) {
+    }
+    // The count lives in the object, so any raw pointer to it may be adopted, even twice
+    explicit IntrusivePtr(T* ptr) : ptr_(ptr) {
+        if (ptr_) {
+            ptr_->IncRef();
+        }
+    }
+
+    IntrusivePtr(const IntrusivePtr& other) : ptr_(other.ptr_) {
+        if (ptr_) {
+            ptr_->IncRef();
+        }
+    }
+    IntrusivePtr(IntrusivePtr&& other) noexcept : ptr_(other.ptr_) {
+        other.ptr_ = nullptr;
+    }
+
+    template <typename S>
+    IntrusivePtr(const IntrusivePtr<S>& other) : ptr_(other.Get()) {
+        if (ptr_) {
+            ptr_->IncRef();
+        }
+    }
+    template <typename S>
+    IntrusivePtr(IntrusivePtr<S>&& other) noexcept : ptr_(other.Detach()) {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    IntrusivePtr& operator=(const IntrusivePtr& other) {
+        IntrusivePtr(other).Swap(*this);
+        return *this;
+    }
+    IntrusivePtr& operator=(IntrusivePtr&& other) noexcept {
+        if (this == &other) {
+            return *this;
+        }
+        IntrusivePtr(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~IntrusivePtr() {
+        if (ptr_) {
+            ptr_->DecRef();
+        }
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        IntrusivePtr().Swap(*this);
+    }
+    void Reset(T* ptr) {
+        IntrusivePtr(ptr).Swap(*this);
+    }
+    void Swap(IntrusivePtr& other) noexcept {
+        std::swap(ptr_, other.ptr_);
+    }
+    // Gives up the reference without decrementing the count
+    T* Detach() noexcept {
+        T* ptr = ptr_;
+        ptr_ = nullptr;
+        return ptr;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    T* Get() const {
+        return ptr_;
+    }
+    T& operator*() const {
+        return *ptr_;
+    }
+    T* operator->() const {
+        return ptr_;
+    }
+    size_t UseCount() const {
+        if (ptr_) {
+            return ptr_->RefCount();
+        }
+        return 0;
+    }
+    explicit operator bool() const {
+        return ptr_ != nullptr;
+    }
+
+private:
+    T* ptr_;
+};
+
+template <typename T>
+struct IsTriviallyRelocatable<IntrusivePtr<T>> : std::true_type {};
+
+template <typename T, typename U>
+inline bool operator==(const IntrusivePtr<T>& left, const IntrusivePtr<U>& right) {
+    return left.Get() == right.Get();
+}
+
+template <typename T, typename... Args>
+IntrusivePtr<T> MakeIntrusive(Args&&... args) {
+    return IntrusivePtr<T>(new T(std::forward<Args>(args)...));
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include "relocation.h"
+#include "shared.h"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Lazily constructed shared objects.
+//
+// `MakeSharedLazy<T>(args...)` allocates the block with room for `T` and a copy of the
+// arguments, but builds the object only when a `LazySharedPtr` to it is first dereferenced. The
+// construction runs exactly once, also when several threads get there at the same time; if it
+// throws, the next dereference tries again. The arguments are dropped once the object exists,
+// and an object that was never needed is never built or destroyed.
+
+template <typename T>
+struct ControlBlockLazyBase : public ControlBlockBase {
+    T* GetRawPtr() {
+        return reinterpret_cast<T*>(&storage);
+    }
+    bool Constructed() const {
+        return constructed.load(std::memory_order_acquire);
+    }
+
+    // `after()` runs once the object exists, before any other thread may use it
+    template <typename After>
+    void EnsureConstructed(After&& after) {
+        if (Constructed()) {
+            return;
+        }
+        // Not `std::call_once`: some implementations never release a flag whose callable threw
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!constructed.load(std::memory_order_relaxed)) {
+            construct(this);
+            after();
+            constructed.store(true, std::memory_order_release);
+        }
+    }
+
+    void Destroy() {
+        if (constructed.load(std::memory_order_relaxed)) {
+            GetRawPtr()->~T();
+        }
+    }
+    const void* FindObject() {
+        return GetRawPtr();
+    }
+    uintptr_t FindObjectType() {
+        return TypeTag<std::remove_cv_t<T>>();
+    }
+
+    // Builds the object from the stored arguments, set by the concrete block
+    void (*construct)(ControlBlockLazyBase* block) = nullptr;
+    std::atomic<bool> constructed{false};
+    std::mutex mutex;
+    std::aligned_storage_t<sizeof(T), alignof(T)> storage;
+};
+
+template <typename T, typename... Args>
+struct ControlBlockLazy : public ControlBlockLazyBase<T> {
+    template <typename... Values>
+    explicit ControlBlockLazy(Values&&... values)
+        : args(std::in_place, std::forward<Values>(values)...) {
+        this->manager = &ManageControlBlock<ControlBlockLazy>;
+        this->construct = &Construct;
+        SW_PTR_BLOCK_CREATED(T);
+    }
+
+    static void Construct(ControlBlockLazyBase<T>* base) {
+        auto block = static_cast<ControlBlockLazy*>(base);
+        std::apply([block](Args&... values) { new (block->GetRawPtr()) T{std::move(values)...}; },
+                   *block->args);
+        block->args.reset();
+    }
+
+    void Deallocate() {
+        delete this;
+    }
+
+    std::optional<std::tuple<Args...>> args;
+};
+
+template <typename T, typename Policy = NonAtomicRefCount>
+class LazySharedPtr;
+
+// The arguments are stored by value, like `std::bind` does, and moved into the constructor
+template <typename T, typename Policy = NonAtomicRefCount, typename... Args>
+LazySharedPtr<T, Policy> MakeSharedLazy(Args&&... args);
+
+// Owns a lazily constructed object like a `SharedPtr`; every access goes through the block's
+// once-check first. `Share()` hands out an ordinary `SharedPtr` to the built object
+template <typename T, typename Policy>
+class LazySharedPtr {
+    static_assert(!std::is_array_v<T>);
+
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    LazySharedPtr() = default;
+    LazySharedPtr(std::nullptr_t) {
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reset() {
+        ptr_.Reset();
+    }
+    void Swap(LazySharedPtr& other) noexcept {
+        ptr_.Swap(other.ptr_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    // Constructs the object if nobody did yet
+    T* Get() const {
+        if (!ptr_) {
+            return nullptr;
+        }
+        auto block = static_cast<ControlBlockLazyBase<T>*>(ptr_.GetBlock());
+        block->EnsureConstructed([this] { const_cast<SharedPtr<T, Policy>&>(ptr_).ESFT(); });
+        return ptr_.Get();
+    }
+    T& operator*() const {
+        return *Get();
+    }
+    T* operator->() const {
+        return Get();
+    }
+    SharedPtr<T, Policy> Share() const {
+        Get();
+        return ptr_;
+    }
+
+    // Neither of these constructs the object
+    bool IsConstructed() const {
+        return ptr_ && static_cast<ControlBlockLazyBase<T>*>(ptr_.GetBlock())->Constructed();
+    }
+    size_t UseCount() const {
+        return ptr_.UseCount();
+    }
+    explicit operator bool() const {
+        return static_cast<bool>(ptr_);
+    }
+
+private:
+    template <typename U, typename P, typename... Args>
+    friend LazySharedPtr<U, P> MakeSharedLazy(Args&&... args);
+
+    // Only ever holds a `ControlBlockLazyBase<T>`
+    explicit LazySharedPtr(SharedPtr<T, Policy> ptr) : ptr_(std::move(ptr)) {
+    }
+
+    SharedPtr<T, Policy> ptr_;
+};
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<LazySharedPtr<T, Policy>> : std::true_type {};
+
+template <typename T, typename Policy, typename... Args>
+LazySharedPtr<T, Policy> MakeSharedLazy(Args&&... args) {
+    static_assert(!std::is_array_v<T>);
+    auto block = new ControlBlockLazy<T, std::decay_t<Args>...>(std::forward<Args>(args)...);
+    return LazySharedPtr<T, Policy>(SharedPtr<T, Policy>(block->GetRawPtr(), block));
+}
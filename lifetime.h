@@ -0,0 +1,42 @@
+#pragma once
+
+// Objects that stay usable while threads and the program shut down. Control blocks may be
+// released from any destructor, including those of thread-local and static objects, so the
+// state they reach has to outlive them.
+
+// One `T` per thread, constructed on first use. `Get()` returns null once the calling thread has
+// started to destroy its instance; callers then fall back to a path that needs none
+template <typename T>
+class ThreadLocalInstance {
+public:
+    static T* Get() {
+        if (Destroyed()) {
+            return nullptr;
+        }
+        thread_local Holder holder;
+        return &holder.value;
+    }
+
+private:
+    struct Holder {
+        // Runs before `value` is destroyed, so its destructor already sees null
+        ~Holder() {
+            Destroyed() = true;
+        }
+
+        T value;
+    };
+
+    static bool& Destroyed() {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+};
+
+// Constructed on first use and never destroyed, so that it can still be used during static
+// destruction. A type with a private constructor befriends `NeverDestroyed<T>`
+template <typename T>
+T& NeverDestroyed() {
+    static T* instance = new T;
+    return *instance;
+}
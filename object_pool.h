@@ -0,0 +1,401 @@
+#pragma once
+
+#include "lifetime.h"
+#include "shared.h"
+#include "unique.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Recycling object pool.
+//
+// `ObjectPool<T>` allocates an object together with its control block once and then reuses both:
+// when the last handle to a pooled object goes away, the object is reset instead of destroyed and
+// its block goes to a free list of the releasing thread. Every thread keeps a few idle objects
+// per pool and trades batches of them with a list shared by all threads, so objects released on
+// a consumer thread flow back to the producer. Blocks keep the pool's bookkeeping alive, handles
+// may outlive the pool; objects released after the pool is gone are destroyed.
+
+struct ObjectPoolOptions {
+    // Idle objects each thread keeps, more go to the shared list
+    size_t thread_cache = 64;
+    // Idle objects in the shared list, more are destroyed
+    size_t capacity = 1024;
+};
+
+template <typename T>
+class ObjectPoolState;
+
+// The object follows the block, so a `PoolDeleter` finds the block from the object pointer alone
+template <typename T>
+struct ControlBlockPooled : public ControlBlockTrailing<ControlBlockPooled<T>, T> {
+    explicit ControlBlockPooled(ObjectPoolState<T>* state);
+
+    static ControlBlockPooled* Create(ObjectPoolState<T>* state) {
+        constexpr size_t bytes = ControlBlockPooled::HeaderSize() + sizeof(T);
+        auto block = new (ControlBlockPooled::AllocateMemory(bytes)) ControlBlockPooled(state);
+        try {
+            new (block->GetRawPtr()) T();
+        } catch (...) {
+            block->Deallocate();
+            throw;
+        }
+        block->OnCreated();
+        return block;
+    }
+
+    void OnCreated() {
+        SW_PTR_BLOCK_CREATED(T);
+    }
+
+    void Destroy() {
+        this->GetRawPtr()->~T();
+    }
+    void Deallocate();
+    const void* FindObject() {
+        return this->GetRawPtr();
+    }
+    uintptr_t FindObjectType() {
+        return TypeTag<T>();
+    }
+
+    ObjectPoolState<T>* state;
+    // Link in a free list
+    ControlBlockPooled* next = nullptr;
+};
+
+// Shared by the pool and all of its blocks, deleted with the last of them
+template <typename T>
+class ObjectPoolState {
+    using Block = ControlBlockPooled<T>;
+
+public:
+    ObjectPoolState(const ObjectPoolOptions& options, std::function<void(T&)> reset)
+        : options_(options), batch_(options.thread_cache / 2 + 1), reset_(std::move(reset)) {
+    }
+
+    ObjectPoolState(const ObjectPoolState& other) = delete;
+    ObjectPoolState& operator=(const ObjectPoolState& other) = delete;
+
+    void AddRef() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Release() {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete this;
+        }
+    }
+
+    // Returns a block holding one strong and the implicit weak reference
+    Block* Take() {
+        Block* block = nullptr;
+        ThreadCache* cache = options_.thread_cache == 0 ? nullptr : CacheFor(this, true);
+        if (cache != nullptr && cache->head == nullptr) {
+            Refill(cache);
+        }
+        if (cache != nullptr && cache->head != nullptr) {
+            block = cache->head;
+            cache->head = block->next;
+            --cache->size;
+        } else if (cache == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (shared_head_ != nullptr) {
+                block = shared_head_;
+                shared_head_ = block->next;
+                --shared_size_;
+            }
+        }
+        if (block == nullptr) {
+            return Block::Create(this);
+        }
+        block->next = nullptr;
+        block->counts.store(ControlBlockBase::kStrongOne | ControlBlockBase::kWeakOne,
+                            std::memory_order_relaxed);
+        return block;
+    }
+
+    // Runs the reset hook, which must not throw
+    void Reset(T& object) {
+        if (reset_) {
+            reset_(object);
+        }
+    }
+
+    // Takes back an idle block whose object was reset
+    void Recycle(Block* block) {
+        if (closed_.load(std::memory_order_relaxed)) {
+            Free(block);
+            return;
+        }
+        ThreadCache* cache = options_.thread_cache == 0 ? nullptr : CacheFor(this, true);
+        if (cache == nullptr) {
+            block->next = nullptr;
+            Spill(block, block, 1);
+            return;
+        }
+        if (cache->size == options_.thread_cache) {
+            Spill(cache, batch_);
+        }
+        block->next = cache->head;
+        cache->head = block;
+        ++cache->size;
+    }
+
+    // Called once by the pool. Idle blocks in the shared list and in the calling thread's cache
+    // are destroyed now, those cached by other threads when the thread next uses or exits
+    void Close() {
+        Block* head;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_.store(true, std::memory_order_relaxed);
+            head = shared_head_;
+            shared_head_ = nullptr;
+            shared_size_ = 0;
+        }
+        FreeList(head);
+        if (ThreadCache* cache = CacheFor(this, false)) {
+            Flush(cache);
+        }
+        Release();
+    }
+
+    size_t SharedIdle() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return shared_size_;
+    }
+
+private:
+    // A thread caches blocks of this many pools at once, blocks of further pools go straight
+    // to their shared lists
+    static constexpr size_t kCacheSlots = 4;
+
+    struct ThreadCache {
+        // Holds a reference while set
+        ObjectPoolState* state = nullptr;
+        Block* head = nullptr;
+        size_t size = 0;
+    };
+
+    struct ThreadCaches {
+        ThreadCaches() = default;
+        ThreadCaches(const ThreadCaches& other) = delete;
+        ThreadCaches& operator=(const ThreadCaches& other) = delete;
+
+        // Destroying flushed objects may release pooled objects, those skip the caches
+        ~ThreadCaches() {
+            for (ThreadCache& cache : slots) {
+                if (cache.state != nullptr) {
+                    Flush(&cache);
+                }
+            }
+        }
+
+        ThreadCache slots[kCacheSlots];
+    };
+
+    // Null while the thread is shutting down, or if all slots are taken and `claim` is set
+    static ThreadCache* CacheFor(ObjectPoolState* state, bool claim) {
+        ThreadCaches* caches = ThreadLocalInstance<ThreadCaches>::Get();
+        if (caches == nullptr) {
+            return nullptr;
+        }
+        for (ThreadCache& cache : caches->slots) {
+            if (cache.state == state) {
+                return &cache;
+            }
+        }
+        if (!claim) {
+            return nullptr;
+        }
+        for (ThreadCache& cache : caches->slots) {
+            if (cache.state != nullptr && cache.state->closed_.load(std::memory_order_relaxed)) {
+                Flush(&cache);
+            }
+            if (cache.state == nullptr) {
+                state->AddRef();
+                cache.state = state;
+                return &cache;
+            }
+        }
+        return nullptr;
+    }
+
+    // Empties `cache` into its pool and gives up the slot
+    static void Flush(ThreadCache* cache) {
+        ObjectPoolState* state = cache->state;
+        if (cache->head != nullptr) {
+            state->Spill(cache, cache->size);
+        }
+        cache->state = nullptr;
+        state->Release();
+    }
+
+    // Moves up to `batch_` blocks from the shared list into `cache`
+    void Refill(ThreadCache* cache) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (shared_head_ != nullptr && cache->size < batch_) {
+            Block* block = shared_head_;
+            shared_head_ = block->next;
+            --shared_size_;
+            block->next = cache->head;
+            cache->head = block;
+            ++cache->size;
+        }
+    }
+
+    // Moves `count` blocks from the top of `cache` to the shared list
+    void Spill(ThreadCache* cache, size_t count) {
+        Block* first = cache->head;
+        Block* last = first;
+        for (size_t i = 1; i < count && last->next != nullptr; ++i) {
+            last = last->next;
+        }
+        cache->head = last->next;
+        cache->size -= std::min(count, cache->size);
+        last->next = nullptr;
+        Spill(first, last, count);
+    }
+
+    // Pushes the chain `first..last` of `count` blocks to the shared list and destroys what
+    // doesn't fit
+    void Spill(Block* first, Block* last, size_t count) {
+        Block* excess = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_.load(std::memory_order_relaxed)) {
+                excess = first;
+            } else {
+                while (count > 0 && shared_size_ + count > options_.capacity) {
+                    Block* block = first;
+                    first = first->next;
+                    block->next = excess;
+                    excess = block;
+                    --count;
+                }
+                if (count > 0) {
+                    last->next = shared_head_;
+                    shared_head_ = first;
+                    shared_size_ += count;
+                }
+            }
+        }
+        FreeList(excess);
+    }
+
+    // The blocks may hold the last references to the state
+    static void FreeList(Block* head) {
+        while (head != nullptr) {
+            Block* block = head;
+            head = block->next;
+            Free(block);
+        }
+    }
+    static void Free(Block* block) {
+        ManageControlBlock<Block>(block, ControlBlockOp::kDestroyAndDeallocate, 0);
+    }
+
+    std::atomic<size_t> refs_{1};
+    std::atomic<bool> closed_{false};
+    const ObjectPoolOptions options_;
+    const size_t batch_;
+    const std::function<void(T&)> reset_;
+
+    std::mutex mutex_;
+    Block* shared_head_ = nullptr;
+    size_t shared_size_ = 0;
+};
+
+// A destroy only resets the object; the block is recycled once no reference of any kind is left
+template <typename T>
+uintptr_t ManagePooledControlBlock(ControlBlockBase* base, ControlBlockOp op, uintptr_t arg) {
+    auto block = static_cast<ControlBlockPooled<T>*>(base);
+    switch (op) {
+        case ControlBlockOp::kDestroy:
+            block->state->Reset(*block->GetRawPtr());
+            return 0;
+        case ControlBlockOp::kDeallocate:
+            block->state->Recycle(block);
+            return 0;
+        case ControlBlockOp::kDestroyAndDeallocate:
+            block->state->Reset(*block->GetRawPtr());
+            block->state->Recycle(block);
+            return 0;
+        default:
+            return ManageControlBlock<ControlBlockPooled<T>>(base, op, arg);
+    }
+}
+
+template <typename T>
+ControlBlockPooled<T>::ControlBlockPooled(ObjectPoolState<T>* state) : state(state) {
+    this->manager = &ManagePooledControlBlock<T>;
+    state->AddRef();
+}
+
+template <typename T>
+void ControlBlockPooled<T>::Deallocate() {
+    ObjectPoolState<T>* owner = state;
+    this->~ControlBlockPooled();
+    ControlBlockPooled::FreeMemory(this);
+    owner->Release();
+}
+
+// Returns an object from `ObjectPool::AcquireUnique` to its pool
+template <typename T>
+struct PoolDeleter {
+    void operator()(T* ptr) const {
+        // `UniquePtr` also passes null, like `delete` it is ignored
+        if (ptr == nullptr) {
+            return;
+        }
+        auto block = ControlBlockPooled<T>::FromObject(ptr);
+        block->state->Reset(*ptr);
+        block->state->Recycle(block);
+    }
+};
+
+// New objects are value-initialized; `reset` runs on every object that comes back, on the
+// thread that released it, and must not throw
+template <typename T, typename Policy = NonAtomicRefCount>
+class ObjectPool {
+    static_assert(!std::is_array_v<T>);
+
+public:
+    explicit ObjectPool(const ObjectPoolOptions& options = ObjectPoolOptions(),
+                        std::function<void(T&)> reset = nullptr)
+        : state_(new ObjectPoolState<T>(options, std::move(reset))) {
+    }
+
+    ObjectPool(const ObjectPool& other) = delete;
+    ObjectPool& operator=(const ObjectPool& other) = delete;
+
+    ~ObjectPool() {
+        state_->Close();
+    }
+
+    SharedPtr<T, Policy> Acquire() {
+        auto block = state_->Take();
+        SharedPtr<T, Policy> result(block->GetRawPtr(), block);
+        result.ESFT();
+        return result;
+    }
+
+    // One pointer wide; the block's counts are not used
+    UniquePtr<T, PoolDeleter<T>> AcquireUnique() {
+        return UniquePtr<T, PoolDeleter<T>>(state_->Take()->GetRawPtr());
+    }
+
+    // Idle objects that any thread can take; per-thread caches are not included
+    size_t SharedIdle() const {
+        return state_->SharedIdle();
+    }
+
+private:
+    ObjectPoolState<T>* state_;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include "lifetime.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+
+// Per-thread free lists of small blocks grouped into size classes. Memory freed on another
+// thread goes to that thread's lists, every cached block is an ordinary `::operator new`
+// allocation, so the lists can be released by any thread. Blocks move between threads in
+// batches: a thread whose list is full hands a batch to a shared list under a mutex, and a
+// thread whose list is empty takes one from there before it falls back to the heap. So when
+// one thread allocates what another frees, both keep reusing the same blocks, at the cost of one
+// lock per batch.
+class PoolFreeLists {
+public:
+    static constexpr size_t kGranularity = alignof(std::max_align_t);
+    static constexpr size_t kMaxSize = 512;
+    static constexpr size_t kClassCount = kMaxSize / kGranularity;
+    // Cached blocks per size class and thread
+    static constexpr size_t kMaxCached = 4096;
+    static constexpr size_t kBatch = 256;
+    // Batches per size class in the shared list, the rest goes back to the global heap
+    static constexpr size_t kMaxSharedBatches = 64;
+
+    PoolFreeLists() = default;
+    PoolFreeLists(const PoolFreeLists& other) = delete;
+    PoolFreeLists& operator=(const PoolFreeLists& other) = delete;
+
+    ~PoolFreeLists() {
+        for (size_t i = 0; i < kClassCount; ++i) {
+            FreeChain(heads_[i]);
+        }
+    }
+
+    static bool Fits(size_t size, size_t alignment) {
+        return size <= kMaxSize && alignment <= kGranularity;
+    }
+
+    // Both work on the calling thread's lists and fall back to the global heap while the thread
+    // is shutting down
+    static void* Allocate(size_t size) {
+        size_t index = ClassIndex(size);
+        PoolFreeLists* lists = Current();
+        if (lists == nullptr || (lists->heads_[index] == nullptr && !lists->Refill(index))) {
+            // Always the full class size, the block may be reused for any request of its class
+            return ::operator new((index + 1) * kGranularity);
+        }
+        Node* node = lists->heads_[index];
+        lists->heads_[index] = node->next;
+        --lists->sizes_[index];
+        return node;
+    }
+    static void Deallocate(void* ptr, size_t size) {
+        size_t index = ClassIndex(size);
+        PoolFreeLists* lists = Current();
+        if (lists == nullptr) {
+            ::operator delete(ptr);
+            return;
+        }
+        if (lists->sizes_[index] == kMaxCached) {
+            lists->Spill(index);
+        }
+        auto node = static_cast<Node*>(ptr);
+        node->next = lists->heads_[index];
+        lists->heads_[index] = node;
+        ++lists->sizes_[index];
+    }
+
+private:
+    struct Node {
+        Node* next;
+        // In the first node of a batch in the shared list
+        Node* next_batch;
+    };
+    static_assert(sizeof(Node) <= kGranularity && kBatch <= kMaxCached);
+
+    struct Shared {
+        std::mutex mutex;
+        Node* batches[kClassCount] = {};
+        // Read without the lock, so that empty classes don't take it
+        std::atomic<size_t> batch_counts[kClassCount] = {};
+    };
+
+    static PoolFreeLists* Current() {
+        return ThreadLocalInstance<PoolFreeLists>::Get();
+    }
+    // Used by threads that are shutting down as well
+    static Shared& SharedLists() {
+        return NeverDestroyed<Shared>();
+    }
+
+    static size_t ClassIndex(size_t size) {
+        return size == 0 ? 0 : (size - 1) / kGranularity;
+    }
+
+    static void FreeChain(Node* node) {
+        while (node != nullptr) {
+            ::operator delete(std::exchange(node, node->next));
+        }
+    }
+
+    // Moves `kBatch` blocks from the full list of the class to the shared list
+    void Spill(size_t index) {
+        Node* batch = heads_[index];
+        Node* last = batch;
+        for (size_t i = 1; i < kBatch; ++i) {
+            last = last->next;
+        }
+        heads_[index] = last->next;
+        sizes_[index] -= kBatch;
+        last->next = nullptr;
+
+        Shared& shared = SharedLists();
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            size_t count = shared.batch_counts[index].load(std::memory_order_relaxed);
+            if (count < kMaxSharedBatches) {
+                batch->next_batch = shared.batches[index];
+                shared.batches[index] = batch;
+                shared.batch_counts[index].store(count + 1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        FreeChain(batch);
+    }
+    // Takes a batch from the shared list into the empty list of the class
+    bool Refill(size_t index) {
+        Shared& shared = SharedLists();
+        if (shared.batch_counts[index].load(std::memory_order_relaxed) == 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        Node* batch = shared.batches[index];
+        if (batch == nullptr) {
+            return false;
+        }
+        shared.batches[index] = batch->next_batch;
+        shared.batch_counts[index].fetch_sub(1, std::memory_order_relaxed);
+        heads_[index] = batch;
+        sizes_[index] = kBatch;
+        return true;
+    }
+
+    Node* heads_[kClassCount] = {};
+    size_t sizes_[kClassCount] = {};
+};
+
+// Stateless allocator on top of `PoolFreeLists`; large or over-aligned requests go straight to
+// `::operator new`
+template <typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+    template <typename S>
+    PoolAllocator(const PoolAllocator<S>&) noexcept {
+    }
+
+    T* allocate(size_t n) {
+        if (n > max_size()) {
+            throw std::bad_array_new_length();
+        }
+        size_t size = n * sizeof(T);
+        if (PoolFreeLists::Fits(size, alignof(T))) {
+            return static_cast<T*>(PoolFreeLists::Allocate(size));
+        }
+        if constexpr (alignof(T) > alignof(std::max_align_t)) {
+            return static_cast<T*>(::operator new(size, std::align_val_t(alignof(T))));
+        } else {
+            return static_cast<T*>(::operator new(size));
+        }
+    }
+    void deallocate(T* ptr, size_t n) noexcept {
+        size_t size = n * sizeof(T);
+        if (PoolFreeLists::Fits(size, alignof(T))) {
+            PoolFreeLists::Deallocate(ptr, size);
+            return;
+        }
+        if constexpr (alignof(T) > alignof(std::max_align_t)) {
+            ::operator delete(ptr, std::align_val_t(alignof(T)));
+        } else {
+            ::operator delete(ptr);
+        }
+    }
+
+    size_t max_size() const noexcept {
+        return SIZE_MAX / sizeof(T);
+    }
+};
+
+template <typename T, typename U>
+inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+    return true;
+}
+template <typename T, typename U>
+inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+    return false;
+}
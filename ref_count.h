@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Reference counting policies. Counters are always stored as `std::atomic`, the policy only
+// decides how they are updated: `NonAtomicRefCount` uses plain relaxed loads and stores (no
+// locked instructions, single-threaded use only), `AtomicRefCount` uses read-modify-write
+// operations and may be shared between threads.
+
+struct NonAtomicRefCount {
+    static constexpr bool kThreadSafe = false;
+
+    template <typename C>
+    static C Load(const std::atomic<C>& cnt) {
+        return cnt.load(std::memory_order_relaxed);
+    }
+    template <typename C, typename D>
+    static void Add(std::atomic<C>& cnt, D delta) {
+        cnt.store(cnt.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    // Returns the value before subtraction
+    template <typename C, typename D>
+    static C FetchSub(std::atomic<C>& cnt, D delta) {
+        C old = cnt.load(std::memory_order_relaxed);
+        cnt.store(old - delta, std::memory_order_relaxed);
+        return old;
+    }
+    template <typename C>
+    static bool CompareExchange(std::atomic<C>& cnt, C& expected, C desired) {
+        C current = cnt.load(std::memory_order_relaxed);
+        if (current != expected) {
+            expected = current;
+            return false;
+        }
+        cnt.store(desired, std::memory_order_relaxed);
+        return true;
+    }
+    static void AcquireFence() {
+    }
+};
+
+struct AtomicRefCount {
+    static constexpr bool kThreadSafe = true;
+
+    template <typename C>
+    static C Load(const std::atomic<C>& cnt) {
+        return cnt.load(std::memory_order_relaxed);
+    }
+    // A new reference is always made from an existing one, so nothing has to be ordered here
+    template <typename C, typename D>
+    static void Add(std::atomic<C>& cnt, D delta) {
+        cnt.fetch_add(delta, std::memory_order_relaxed);
+    }
+    // Release publishes our writes to the object; whoever drops the last reference must call
+    // `AcquireFence()` before destroying it
+    template <typename C, typename D>
+    static C FetchSub(std::atomic<C>& cnt, D delta) {
+        return cnt.fetch_sub(delta, std::memory_order_release);
+    }
+    template <typename C>
+    static bool CompareExchange(std::atomic<C>& cnt, C& expected, C desired) {
+        return cnt.compare_exchange_weak(expected, desired, std::memory_order_relaxed,
+                                         std::memory_order_relaxed);
+    }
+    static void AcquireFence() {
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+};
+
+// `NonAtomicRefCount` that counts the updates it performs on the calling thread, so that tests
+// can pin down how much counter traffic an operation takes
+struct CountingRefCount : public NonAtomicRefCount {
+    struct Ops {
+        size_t adds = 0;
+        size_t subs = 0;
+        // Successful ones only
+        size_t exchanges = 0;
+
+        size_t Total() const {
+            return adds + subs + exchanges;
+        }
+    };
+
+    static Ops& Counted() {
+        thread_local Ops ops;
+        return ops;
+    }
+    static void ResetCounted() {
+        Counted() = Ops{};
+    }
+
+    template <typename C, typename D>
+    static void Add(std::atomic<C>& cnt, D delta) {
+        ++Counted().adds;
+        NonAtomicRefCount::Add(cnt, delta);
+    }
+    template <typename C, typename D>
+    static C FetchSub(std::atomic<C>& cnt, D delta) {
+        ++Counted().subs;
+        return NonAtomicRefCount::FetchSub(cnt, delta);
+    }
+    template <typename C>
+    static bool CompareExchange(std::atomic<C>& cnt, C& expected, C desired) {
+        if (!NonAtomicRefCount::CompareExchange(cnt, expected, desired)) {
+            return false;
+        }
+        ++Counted().exchanges;
+        return true;
+    }
+};
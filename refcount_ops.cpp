@@ -0,0 +1,90 @@
+// Counts the reference count updates of the hot `SharedPtr` / `WeakPtr` paths with
+// `CountingRefCount` and fails if any of them does more than it has to.
+//
+// Build and run:
+//     g++ -std=c++17 -O2 refcount_ops.cpp -o refcount_ops && ./refcount_ops
+//
+// Prints one line per checked operation and exits with a non-zero status on the first mismatch.
+
+#include "shared.h"
+#include "weak.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+
+namespace {
+
+using Policy = CountingRefCount;
+
+struct Base {
+    virtual ~Base() = default;
+};
+
+struct Derived : public Base {};
+
+struct Self : public EnableSharedFromThis<Self, Policy> {};
+
+// Runs `body` and compares the number of counter updates it made with `expected`
+template <typename F>
+void Expect(const char* name, size_t expected, F&& body) {
+    Policy::ResetCounted();
+    body();
+    size_t actual = Policy::Counted().Total();
+    std::printf("%-32s %zu\n", name, actual);
+    if (actual != expected) {
+        std::fprintf(stderr, "%s: expected %zu counter updates, got %zu\n", name, expected,
+                     actual);
+        std::exit(1);
+    }
+}
+
+}  // namespace
+
+int main() {
+    {
+        auto derived = MakeShared<Derived, Policy>();
+        SharedPtr<Base, Policy> base;
+        Expect("shared_converting_move", 0, [&] {
+            base = SharedPtr<Base, Policy>(std::move(derived));
+        });
+    }
+    {
+        auto derived = MakeShared<Derived, Policy>();
+        WeakPtr<Derived, Policy> weak(derived);
+        WeakPtr<Base, Policy> base;
+        Expect("weak_converting_move", 0, [&] {
+            base = WeakPtr<Base, Policy>(std::move(weak));
+        });
+    }
+    {
+        auto ptr = MakeShared<Base, Policy>();
+        WeakPtr<Base, Policy> weak(ptr);
+        SharedPtr<Base, Policy> locked;
+        Expect("weak_lock", 1, [&] {
+            locked = weak.Lock();
+        });
+    }
+    {
+        auto ptr = MakeShared<Base, Policy>();
+        WeakPtr<Base, Policy> weak(ptr);
+        Expect("last_release_with_weak", 2, [&] {
+            ptr.Reset();
+        });
+    }
+    {
+        auto ptr = MakeShared<Base, Policy>();
+        Expect("last_release", 1, [&] {
+            ptr.Reset();
+        });
+    }
+    {
+        auto ptr = MakeShared<Self, Policy>();
+        SharedPtr<Self, Policy> copy;
+        Expect("shared_from_this_copy", 1, [&] {
+            copy = ptr;
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "sw_fwd.h"
+
+// Registry of live control blocks.
+//
+// Compiled in only when `SW_PTR_BLOCK_REGISTRY` is defined, identically in every translation
+// unit. Every block created through the library is linked into one of several intrusive lists,
+// chosen by the creating thread, until it is deallocated. `SnapshotControlBlocks()` lists them
+// with their counts; a block whose object is already destroyed but which is still held by
+// `WeakPtr`s is reported as a zombie, for `MakeShared` objects it pins the whole allocation.
+
+#ifndef SW_PTR_BLOCK_REGISTRY
+#error "registry.h requires SW_PTR_BLOCK_REGISTRY"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+struct BlockTypeInfo {
+    const std::string* name;
+    size_t size;
+};
+
+template <typename T>
+const BlockTypeInfo* BlockTypeInfoOf() {
+    // Arrays are reported by the size of one element
+    static const BlockTypeInfo info{&TypeName<T>(), sizeof(std::remove_extent_t<T>)};
+    return &info;
+}
+
+struct ControlBlockSnapshot {
+    const void* block;
+    std::string type;
+    size_t size;
+    size_t strong;
+    // Not counting the one shared by the strong owners
+    size_t weak;
+    bool zombie;
+};
+
+class BlockRegistry {
+    static constexpr size_t kShards = 64;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        ControlBlockBase* head = nullptr;
+    };
+
+public:
+    static BlockRegistry& Instance() {
+        return NeverDestroyed<BlockRegistry>();
+    }
+
+    void Register(ControlBlockBase* block, const BlockTypeInfo* type) {
+        size_t index = CurrentShard();
+        Shard& shard = shards_[index];
+        block->registry_type = type;
+        block->registry_shard = index;
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        block->registry_next = shard.head;
+        if (shard.head != nullptr) {
+            shard.head->registry_prev = block;
+        }
+        shard.head = block;
+    }
+    void Unregister(ControlBlockBase* block) {
+        if (block->registry_type == nullptr) {
+            return;
+        }
+        Shard& shard = shards_[block->registry_shard];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (block->registry_prev != nullptr) {
+            block->registry_prev->registry_next = block->registry_next;
+        } else {
+            shard.head = block->registry_next;
+        }
+        if (block->registry_next != nullptr) {
+            block->registry_next->registry_prev = block->registry_prev;
+        }
+    }
+
+    // Blocks can't be deallocated while their shard is being read
+    std::vector<ControlBlockSnapshot> Snapshot() {
+        std::vector<ControlBlockSnapshot> result;
+        for (Shard& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (ControlBlockBase* block = shard.head; block != nullptr;
+                 block = block->registry_next) {
+                bool destroyed = block->destroyed.load(std::memory_order_relaxed);
+                uint64_t weak = block->counts.load(std::memory_order_relaxed) /
+                                ControlBlockBase::kWeakOne;
+                result.push_back(ControlBlockSnapshot{
+                    block, *block->registry_type->name, block->registry_type->size,
+                    destroyed ? 0 : block->StrongCount<AtomicRefCount>(),
+                    static_cast<size_t>(destroyed || weak == 0 ? weak : weak - 1), destroyed});
+            }
+        }
+        return result;
+    }
+
+private:
+    friend BlockRegistry& NeverDestroyed<BlockRegistry>();
+
+    BlockRegistry() = default;
+
+    size_t CurrentShard() {
+        thread_local size_t index = next_shard_.fetch_add(1, std::memory_order_relaxed) % kShards;
+        return index;
+    }
+
+    Shard shards_[kShards];
+    std::atomic<size_t> next_shard_{0};
+};
+
+inline void RegisterControlBlock(ControlBlockBase* block, const BlockTypeInfo* type) {
+    BlockRegistry::Instance().Register(block, type);
+}
+inline void UnregisterControlBlock(ControlBlockBase* block) {
+    BlockRegistry::Instance().Unregister(block);
+}
+
+inline std::vector<ControlBlockSnapshot> SnapshotControlBlocks() {
+    return BlockRegistry::Instance().Snapshot();
+}
+
+// One line per type: live blocks, zombies and reference totals
+inline void DumpControlBlocks(std::FILE* out = stderr) {
+    struct Summary {
+        size_t size = 0;
+        size_t blocks = 0;
+        size_t zombies = 0;
+        size_t strong = 0;
+        size_t weak = 0;
+    };
+    std::map<std::string, Summary> by_type;
+    for (const ControlBlockSnapshot& snapshot : SnapshotControlBlocks()) {
+        Summary& summary = by_type[snapshot.type];
+        summary.size = snapshot.size;
+        ++summary.blocks;
+        summary.zombies += snapshot.zombie;
+        summary.strong += snapshot.strong;
+        summary.weak += snapshot.weak;
+    }
+    for (const auto& [type, summary] : by_type) {
+        std::fprintf(out, "%s (%zu bytes): blocks %zu, zombies %zu, strong %zu, weak %zu\n",
+                     type.c_str(), summary.size, summary.blocks, summary.zombies, summary.strong,
+                     summary.weak);
+    }
+}
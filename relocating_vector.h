@@ -0,0 +1,211 @@
+#pragma once
+
+#include "relocation.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+// Growable array that reallocates with `Relocate`: arrays of handles are moved with one `memcpy`
+// and no reference count traffic, other types the way `std::vector` moves them.
+template <typename T>
+class RelocatingVector {
+public:
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Constructors
+
+    RelocatingVector() : data_(nullptr), size_(0), capacity_(0) {
+    }
+    RelocatingVector(std::initializer_list<T> values) : RelocatingVector() {
+        Reserve(values.size());
+        for (const T& value : values) {
+            PushBack(value);
+        }
+    }
+
+    RelocatingVector(const RelocatingVector& other) : RelocatingVector() {
+        Reserve(other.size_);
+        for (const T& value : other) {
+            PushBack(value);
+        }
+    }
+    RelocatingVector(RelocatingVector&& other) noexcept
+        : data_(other.data_), size_(other.size_), capacity_(other.capacity_) {
+        other.data_ = nullptr;
+        other.size_ = 0;
+        other.capacity_ = 0;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // `operator=`-s
+
+    RelocatingVector& operator=(const RelocatingVector& other) {
+        if (this != &other) {
+            RelocatingVector(other).Swap(*this);
+        }
+        return *this;
+    }
+    RelocatingVector& operator=(RelocatingVector&& other) noexcept {
+        RelocatingVector(std::move(other)).Swap(*this);
+        return *this;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Destructor
+
+    ~RelocatingVector() {
+        Clear();
+        Deallocate(data_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Modifiers
+
+    void Reserve(size_t capacity) {
+        if (capacity > capacity_) {
+            T* data = Allocate(capacity);
+            try {
+                Relocate(data_, size_, data);
+            } catch (...) {
+                Deallocate(data);
+                throw;
+            }
+            Deallocate(data_);
+            data_ = data;
+            capacity_ = capacity;
+        }
+    }
+
+    void PushBack(const T& value) {
+        EmplaceBack(value);
+    }
+    void PushBack(T&& value) {
+        EmplaceBack(std::move(value));
+    }
+    template <typename... Args>
+    T& EmplaceBack(Args&&... args) {
+        if (size_ < capacity_) {
+            new (data_ + size_) T(std::forward<Args>(args)...);
+            return data_[size_++];
+        }
+        // `args` may refer to an element, so it is constructed before the old array is relocated
+        size_t capacity = NextCapacity();
+        T* data = Allocate(capacity);
+        try {
+            new (data + size_) T(std::forward<Args>(args)...);
+        } catch (...) {
+            Deallocate(data);
+            throw;
+        }
+        try {
+            Relocate(data_, size_, data);
+        } catch (...) {
+            data[size_].~T();
+            Deallocate(data);
+            throw;
+        }
+        Deallocate(data_);
+        data_ = data;
+        capacity_ = capacity;
+        return data_[size_++];
+    }
+
+    void PopBack() {
+        data_[--size_].~T();
+    }
+    void Clear() {
+        while (size_ > 0) {
+            PopBack();
+        }
+    }
+    void Swap(RelocatingVector& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+    // Observers
+
+    size_t Size() const {
+        return size_;
+    }
+    size_t Capacity() const {
+        return capacity_;
+    }
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    T* Data() {
+        return data_;
+    }
+    const T* Data() const {
+        return data_;
+    }
+    T& operator[](size_t index) {
+        return data_[index];
+    }
+    const T& operator[](size_t index) const {
+        return data_[index];
+    }
+    T& Back() {
+        return data_[size_ - 1];
+    }
+    const T& Back() const {
+        return data_[size_ - 1];
+    }
+
+    T* begin() {
+        return data_;
+    }
+    T* end() {
+        return data_ + size_;
+    }
+    const T* begin() const {
+        return data_;
+    }
+    const T* end() const {
+        return data_ + size_;
+    }
+
+private:
+    size_t NextCapacity() const {
+        if (capacity_ >= SIZE_MAX / sizeof(T) / 2) {
+            throw std::length_error("RelocatingVector is too large");
+        }
+        return std::max<size_t>(capacity_ * 2, 4);
+    }
+
+    static T* Allocate(size_t capacity) {
+        if (capacity > SIZE_MAX / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return static_cast<T*>(
+                ::operator new(capacity * sizeof(T), std::align_val_t(alignof(T))));
+        } else {
+            return static_cast<T*>(::operator new(capacity * sizeof(T)));
+        }
+    }
+    static void Deallocate(T* data) {
+        if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(data, std::align_val_t(alignof(T)));
+        } else {
+            ::operator delete(data);
+        }
+    }
+
+    T* data_;
+    size_t size_;
+    size_t capacity_;
+};
+
+// The buffer is owned through a plain pointer
+template <typename T>
+struct IsTriviallyRelocatable<RelocatingVector<T>> : std::true_type {};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Trivial relocation.
+//
+// Moving an object to new storage and destroying the source is, for a type that holds no
+// pointers into itself, the same as copying its bytes and forgetting the source. Handles are such
+// types: a relocated `SharedPtr` still owns exactly one reference. Types opt in by specializing
+// `IsTriviallyRelocatable`; containers then move whole arrays of them with `memcpy`.
+
+template <typename T>
+struct IsTriviallyRelocatable : std::is_trivially_copyable<T> {};
+
+template <typename T>
+struct IsTriviallyRelocatable<const T> : IsTriviallyRelocatable<T> {};
+
+// Moves `count` objects from `src` into uninitialized `dst` and ends their lifetime at `src`.
+// If a copy throws (only for types that are neither relocatable nor nothrow movable), `src` is
+// left intact and nothing is constructed at `dst`
+template <typename T>
+void Relocate(T* src, size_t count, T* dst) {
+    if constexpr (IsTriviallyRelocatable<T>::value) {
+        if (count != 0) {
+            std::memcpy(static_cast<void*>(dst), static_cast<const void*>(src), count * sizeof(T));
+        }
+    } else {
+        size_t constructed = 0;
+        try {
+            for (; constructed < count; ++constructed) {
+                new (dst + constructed) T(std::move_if_noexcept(src[constructed]));
+            }
+        } catch (...) {
+            for (size_t i = 0; i < constructed; ++i) {
+                dst[i].~T();
+            }
+            throw;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            src[i].~T();
+        }
+    }
+}
@@ -0,0 +1,620 @@
+#pragma once
+
+#include "shared.h"
+#include "weak.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Sharing-preserving serialization of object graphs.
+//
+// `GraphWriter` saves everything reachable from its roots through `SharedPtr` and `WeakPtr`
+// edges. Objects are deduplicated by control block, so an object shared by many pointers is
+// saved once and comes back shared, and cycles through weak edges come back as cycles. Aliasing
+// pointers are saved as their object plus an offset. Every object type provides
+//     void SaveNode(GraphWriter& out, const T& object);
+//     void LoadNode(GraphReader& in, T& object);
+// which write and read the members in the same order; they are found by argument-dependent
+// lookup. `LoadNode` fills a value-initialized object.
+//
+// The image is flat: a header, a table of nodes, a table of edges, the roots and the payloads,
+// all addressed by offsets. `GraphView` reads it in place, e.g. straight from a mapped file,
+// without building any object. `GraphReader` gives every object its own block like `MakeShared`,
+// once the size and alignment stored for it match the type it is read as, so a corrupt image
+// can't make it allocate more than the objects it actually builds. Images hold host-endian data
+// and are read by the same build that wrote them.
+
+class GraphFormatError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr char kGraphMagic[8] = "SWGRAPH";
+inline constexpr uint32_t kGraphVersion = 1;
+// A null pointer in a payload, and the node of a weak edge to an object nobody owned
+inline constexpr uint32_t kGraphNull = UINT32_MAX;
+
+struct GraphFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t root_count;
+    uint64_t node_count;
+    uint64_t edge_count;
+    uint64_t nodes_offset;
+    uint64_t edges_offset;
+    uint64_t roots_offset;
+    uint64_t size;
+};
+
+struct GraphFileNode {
+    uint64_t payload_offset;
+    uint64_t payload_size;
+    uint64_t object_size;
+    uint64_t object_align;
+};
+
+// Edge flags
+inline constexpr uint32_t kGraphEdgeWeak = 1;
+// The pointer has the type the object was saved as and points to the whole object
+inline constexpr uint32_t kGraphEdgeOwning = 2;
+
+struct GraphFileEdge {
+    uint32_t node;
+    uint32_t flags;
+    // Of the pointer from the start of the object, for aliasing pointers
+    uint64_t offset;
+};
+
+class GraphWriter;
+class GraphReader;
+
+// Whether `T` has `SaveNode` and `LoadNode`; other types can only be reached through aliasing
+// pointers
+template <typename T, typename = void>
+struct HasSaveNode : std::false_type {};
+template <typename T>
+struct HasSaveNode<T, std::void_t<decltype(SaveNode(std::declval<GraphWriter&>(),
+                                                    std::declval<const T&>()))>>
+    : std::true_type {};
+
+template <typename T, typename = void>
+struct HasLoadNode : std::false_type {};
+template <typename T>
+struct HasLoadNode<T, std::void_t<decltype(LoadNode(std::declval<GraphReader&>(),
+                                                    std::declval<T&>()))>> : std::true_type {};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Writing
+
+class GraphWriter {
+public:
+    GraphWriter() = default;
+    GraphWriter(const GraphWriter& other) = delete;
+    GraphWriter& operator=(const GraphWriter& other) = delete;
+
+    ~GraphWriter() {
+        for (auto [block, release] : held_) {
+            release(block);
+        }
+    }
+
+    // The writer keeps its roots alive; the graph must not change until `Finish()`
+    template <typename T, typename Policy>
+    void AddRoot(const SharedPtr<T, Policy>& root) {
+        if (!root) {
+            roots_.push_back(kGraphNull);
+            return;
+        }
+        root.GetBlock()->template AddStrong<Policy>();
+        held_.emplace_back(root.GetBlock(), &Release<Policy>);
+        roots_.push_back(AddEdge(root, 0));
+    }
+
+    // Serializes everything reachable from the roots. An object is saved as the type of the first
+    // ordinary pointer to it, or only as its own type if its block knows it. Throws
+    // `GraphFormatError` if an aliasing pointer refers to an object that is never saved, or if a
+    // pointer reaches past the object it was saved as
+    std::vector<char> Finish();
+
+    // For `SaveNode`
+    template <typename V>
+    void Write(const V& value) {
+        static_assert(std::is_trivially_copyable_v<V>, "Provide an overload for this type");
+        WriteBytes(&value, sizeof(V));
+    }
+    void Write(const std::string& value) {
+        WriteBytes(std::string_view(value));
+    }
+    void WriteBytes(std::string_view bytes) {
+        Write<uint64_t>(bytes.size());
+        WriteBytes(bytes.data(), bytes.size());
+    }
+    void WriteBytes(const void* data, size_t size) {
+        auto bytes = static_cast<const char*>(data);
+        payloads_.insert(payloads_.end(), bytes, bytes + size);
+    }
+    template <typename T, typename Policy>
+    void Write(const SharedPtr<T, Policy>& ptr) {
+        Write<uint32_t>(ptr ? AddEdge(ptr, 0) : kGraphNull);
+    }
+    template <typename T, typename Policy>
+    void Write(const WeakPtr<T, Policy>& ptr) {
+        auto locked = ptr.Lock();
+        Write<uint32_t>(locked ? AddEdge(locked, kGraphEdgeWeak) : kGraphNull);
+    }
+
+private:
+    using SaveFunction = void (*)(GraphWriter& out, const void* object);
+
+    struct Node {
+        const void* object;
+        // Set once an ordinary pointer reaches the object
+        SaveFunction save = nullptr;
+        uint64_t size = 0;
+        uint64_t align = 0;
+        uint32_t file_index = kGraphNull;
+    };
+    struct Edge {
+        uint32_t node;
+        uint32_t flags;
+        uint64_t offset;
+        // Type of the pointer
+        SaveFunction type;
+        uint64_t size;
+    };
+
+    template <typename T>
+    static void Save(GraphWriter& out, const void* object) {
+        SaveNode(out, *static_cast<const T*>(object));
+    }
+    template <typename Policy>
+    static void Release(ControlBlockBase* block) {
+        block->ReleaseStrong<Policy>();
+    }
+
+    template <typename T, typename Policy>
+    uint32_t AddEdge(const SharedPtr<T, Policy>& ptr, uint32_t flags) {
+        using Object = std::remove_cv_t<T>;
+        static_assert(!std::is_array_v<T>, "Arrays are not supported");
+        ControlBlockBase* block = ptr.GetBlock();
+        auto raw = static_cast<const void*>(ptr.Get());
+        auto object = reinterpret_cast<const void*>(block->Dispatch(ControlBlockOp::kGetObject));
+        // Zero if the block can't tell, the first ordinary pointer then decides
+        uintptr_t object_type = block->Dispatch(ControlBlockOp::kGetObjectType);
+        // Blocks that don't know their object (`AdoptImmortal`) are shared by many objects
+        const void* key = object ? static_cast<const void*>(block) : raw;
+        if (!object) {
+            object = raw;
+        }
+        auto [it, inserted] = node_index_.try_emplace(key, nodes_.size());
+        if (inserted) {
+            nodes_.push_back(Node{object});
+        }
+        SaveFunction type = nullptr;
+        if constexpr (HasSaveNode<Object>::value) {
+            type = &Save<Object>;
+        }
+        Node& node = nodes_[it->second];
+        if (type && raw == object && !(flags & kGraphEdgeWeak) && node.save == nullptr &&
+            (object_type == 0 || object_type == TypeTag<Object>())) {
+            node.save = type;
+            node.size = sizeof(Object);
+            node.align = alignof(Object);
+            node.file_index = static_cast<uint32_t>(order_.size());
+            order_.push_back(it->second);
+        }
+        auto offset = static_cast<const char*>(raw) - static_cast<const char*>(object);
+        edges_.push_back(Edge{static_cast<uint32_t>(it->second), flags,
+                              static_cast<uint64_t>(offset), type, sizeof(Object)});
+        return static_cast<uint32_t>(edges_.size() - 1);
+    }
+
+    // Payloads of all nodes in `order_`, back to back
+    std::vector<char> payloads_;
+    std::vector<Node> nodes_;
+    std::unordered_map<const void*, size_t> node_index_;
+    // Nodes to save, in file order
+    std::vector<size_t> order_;
+    std::vector<Edge> edges_;
+    std::vector<uint32_t> roots_;
+    std::vector<std::pair<ControlBlockBase*, void (*)(ControlBlockBase*)>> held_;
+};
+
+inline std::vector<char> GraphWriter::Finish() {
+    std::vector<GraphFileNode> file_nodes;
+    // Saving a node may append to `order_`
+    for (size_t i = 0; i < order_.size(); ++i) {
+        size_t begin = payloads_.size();
+        Node node = nodes_[order_[i]];
+        node.save(*this, node.object);
+        file_nodes.push_back(GraphFileNode{begin, payloads_.size() - begin, node.size, node.align});
+    }
+
+    std::vector<GraphFileEdge> file_edges;
+    file_edges.reserve(edges_.size());
+    for (const Edge& edge : edges_) {
+        const Node& node = nodes_[edge.node];
+        if (node.save == nullptr) {
+            if (!(edge.flags & kGraphEdgeWeak)) {
+                throw GraphFormatError("Aliased object is not reachable through its own type");
+            }
+            file_edges.push_back(GraphFileEdge{kGraphNull, edge.flags, 0});
+            continue;
+        }
+        // E.g. a pointer to a derived class, if the object was first reached as its base
+        if (edge.offset > node.size || edge.size > node.size - edge.offset) {
+            throw GraphFormatError("Pointer reaches past the object it was saved as");
+        }
+        uint32_t flags = edge.flags;
+        if (edge.offset == 0 && edge.type != nullptr && edge.type == node.save) {
+            flags |= kGraphEdgeOwning;
+        }
+        file_edges.push_back(GraphFileEdge{node.file_index, flags, edge.offset});
+    }
+
+    GraphFileHeader header = {};
+    std::memcpy(header.magic, kGraphMagic, sizeof(header.magic));
+    header.version = kGraphVersion;
+    header.root_count = static_cast<uint32_t>(roots_.size());
+    header.node_count = file_nodes.size();
+    header.edge_count = file_edges.size();
+    header.nodes_offset = sizeof(GraphFileHeader);
+    header.edges_offset = header.nodes_offset + file_nodes.size() * sizeof(GraphFileNode);
+    header.roots_offset = header.edges_offset + file_edges.size() * sizeof(GraphFileEdge);
+    uint64_t payloads_offset = header.roots_offset + roots_.size() * sizeof(uint32_t);
+    header.size = payloads_offset + payloads_.size();
+    for (GraphFileNode& node : file_nodes) {
+        node.payload_offset += payloads_offset;
+    }
+
+    std::vector<char> image(header.size);
+    std::memcpy(image.data(), &header, sizeof(header));
+    auto copy = [&image](uint64_t offset, const auto& values) {
+        if (!values.empty()) {
+            std::memcpy(image.data() + offset, values.data(), values.size() * sizeof(values[0]));
+        }
+    };
+    copy(header.nodes_offset, file_nodes);
+    copy(header.edges_offset, file_edges);
+    copy(header.roots_offset, roots_);
+    copy(payloads_offset, payloads_);
+    return image;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Reading in place
+
+// Reads consecutive values of one payload; fields are copied out, so the image needs no
+// alignment
+class GraphPayload {
+public:
+    GraphPayload() = default;
+    GraphPayload(const char* begin, const char* end) : pos_(begin), end_(end) {
+    }
+
+    template <typename V>
+    V Read() {
+        V value;
+        ReadBytes(&value, sizeof(V));
+        return value;
+    }
+    void ReadBytes(void* data, size_t size) {
+        std::memcpy(data, Take(size), size);
+    }
+    // Points into the image
+    std::string_view ReadBytes() {
+        auto size = Read<uint64_t>();
+        return std::string_view(Take(size), size);
+    }
+    // Index of an edge, or `kGraphNull`
+    uint32_t ReadEdge() {
+        return Read<uint32_t>();
+    }
+
+    size_t Remaining() const {
+        return end_ - pos_;
+    }
+
+private:
+    const char* Take(uint64_t size) {
+        if (size > Remaining()) {
+            throw GraphFormatError("Read past the end of a payload");
+        }
+        const char* data = pos_;
+        pos_ += size;
+        return data;
+    }
+
+    const char* pos_ = nullptr;
+    const char* end_ = nullptr;
+};
+
+// Checks the image once and then reads it in place; the image must outlive the view
+class GraphView {
+public:
+    GraphView(const void* data, size_t size) : data_(static_cast<const char*>(data)) {
+        if (size < sizeof(GraphFileHeader)) {
+            throw GraphFormatError("Image is too small");
+        }
+        std::memcpy(&header_, data_, sizeof(header_));
+        if (std::memcmp(header_.magic, kGraphMagic, sizeof(header_.magic)) != 0 ||
+            header_.version != kGraphVersion) {
+            throw GraphFormatError("Not a graph image of this version");
+        }
+        if (header_.size > size || !Fits(header_.nodes_offset, header_.node_count,
+                                         sizeof(GraphFileNode)) ||
+            !Fits(header_.edges_offset, header_.edge_count, sizeof(GraphFileEdge)) ||
+            !Fits(header_.roots_offset, header_.root_count, sizeof(uint32_t))) {
+            throw GraphFormatError("Image is truncated");
+        }
+        for (size_t i = 0; i < NodeCount(); ++i) {
+            GraphFileNode node = Node(i);
+            if (!Fits(node.payload_offset, node.payload_size, 1) || node.object_align == 0 ||
+                (node.object_align & (node.object_align - 1)) != 0) {
+                throw GraphFormatError("Bad node");
+            }
+        }
+        for (size_t i = 0; i < EdgeCount(); ++i) {
+            if (Edge(i).node != kGraphNull && Edge(i).node >= NodeCount()) {
+                throw GraphFormatError("Bad edge");
+            }
+        }
+        for (size_t i = 0; i < RootCount(); ++i) {
+            if (Root(i) != kGraphNull && Root(i) >= EdgeCount()) {
+                throw GraphFormatError("Bad root");
+            }
+        }
+    }
+
+    size_t NodeCount() const {
+        return header_.node_count;
+    }
+    size_t EdgeCount() const {
+        return header_.edge_count;
+    }
+    size_t RootCount() const {
+        return header_.root_count;
+    }
+
+    GraphFileNode Node(size_t index) const {
+        return Load<GraphFileNode>(header_.nodes_offset + index * sizeof(GraphFileNode));
+    }
+    GraphFileEdge Edge(size_t index) const {
+        return Load<GraphFileEdge>(header_.edges_offset + index * sizeof(GraphFileEdge));
+    }
+    // Index of the root's edge, or `kGraphNull`
+    uint32_t Root(size_t index) const {
+        return Load<uint32_t>(header_.roots_offset + index * sizeof(uint32_t));
+    }
+    GraphPayload Payload(size_t node) const {
+        GraphFileNode entry = Node(node);
+        const char* begin = data_ + entry.payload_offset;
+        return GraphPayload(begin, begin + entry.payload_size);
+    }
+
+private:
+    bool Fits(uint64_t offset, uint64_t count, uint64_t size) const {
+        return offset <= header_.size && count <= (header_.size - offset) / size;
+    }
+    template <typename V>
+    V Load(uint64_t offset) const {
+        V value;
+        std::memcpy(&value, data_ + offset, sizeof(V));
+        return value;
+    }
+
+    const char* data_;
+    GraphFileHeader header_;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Loading
+
+// Builds objects from an image on demand: `Root()` loads everything reachable from one root that
+// is not loaded yet. The reader keeps the objects alive until it is destroyed; after that they
+// live as long as pointers to them do. An aliasing pointer stays null until the object it points
+// into is loaded
+class GraphReader {
+public:
+    explicit GraphReader(const GraphView& view) : view_(view), slots_(view.NodeCount()) {
+    }
+
+    GraphReader(const GraphReader& other) = delete;
+    GraphReader& operator=(const GraphReader& other) = delete;
+
+    ~GraphReader() {
+        for (Slot& slot : slots_) {
+            if (slot.block != nullptr) {
+                slot.release(slot.block);
+            }
+        }
+    }
+
+    template <typename T, typename Policy = NonAtomicRefCount>
+    SharedPtr<T, Policy> Root(size_t index) {
+        SharedPtr<T, Policy> root;
+        if (index >= view_.RootCount()) {
+            throw GraphFormatError("No such root");
+        }
+        if (view_.Root(index) != kGraphNull && !ReadEdge(view_.Root(index), &root, false)) {
+            throw GraphFormatError("Root points into an object that is not loaded yet");
+        }
+        LoadPending();
+        return root;
+    }
+
+    // For `LoadNode`
+    template <typename V>
+    void Read(V& value) {
+        static_assert(std::is_trivially_copyable_v<V>, "Provide an overload for this type");
+        payload_.ReadBytes(&value, sizeof(V));
+    }
+    void Read(std::string& value) {
+        value = ReadBytes();
+    }
+    std::string_view ReadBytes() {
+        return payload_.ReadBytes();
+    }
+    // An aliasing pointer may be set later, so it has to be read into its final place
+    template <typename T, typename Policy>
+    void Read(SharedPtr<T, Policy>& ptr) {
+        ptr.Reset();
+        ReadEdge(payload_.ReadEdge(), &ptr, true);
+    }
+    template <typename T, typename Policy>
+    void Read(WeakPtr<T, Policy>& ptr) {
+        ptr.Reset();
+        ReadEdge(payload_.ReadEdge(), &ptr, true);
+    }
+
+private:
+    using LoadFunction = void (*)(GraphReader& in, void* object);
+    using ReleaseFunction = void (*)(ControlBlockBase* block);
+    using AssignFunction = void (*)(void* target, char* object, uint64_t offset,
+                                    ControlBlockBase* block);
+
+    struct Slot {
+        // Set once the object exists, holds a strong reference
+        ControlBlockBase* block = nullptr;
+        char* object = nullptr;
+        // `TypeTag` of the type the object was built as
+        uintptr_t type = 0;
+        LoadFunction load = nullptr;
+        ReleaseFunction release = nullptr;
+    };
+    // An aliasing pointer waiting for its object
+    struct Fixup {
+        void* target;
+        uint64_t offset;
+        AssignFunction assign;
+        // Type the object has to be built as, zero if any will do
+        uintptr_t type;
+    };
+
+    template <typename T>
+    static void Load(GraphReader& in, void* object) {
+        LoadNode(in, *static_cast<T*>(object));
+    }
+    template <typename Policy>
+    static void Release(ControlBlockBase* block) {
+        block->ReleaseStrong<Policy>();
+    }
+    // `Ptr` is `SharedPtr` or `WeakPtr`
+    template <template <typename, typename> class Ptr, typename T, typename Policy>
+    static void Assign(void* target, char* object, uint64_t offset, ControlBlockBase* block) {
+        if constexpr (std::is_same_v<Ptr<T, Policy>, SharedPtr<T, Policy>>) {
+            block->AddStrong<Policy>();
+        } else {
+            block->AddWeak<Policy>();
+        }
+        *static_cast<Ptr<T, Policy>*>(target) = Ptr<T, Policy>(
+            reinterpret_cast<std::remove_extent_t<T>*>(object + offset), block);
+    }
+
+    // Returns false if `target` is left for a fixup, or if `defer` is not set, left null
+    template <template <typename, typename> class Ptr, typename T, typename Policy>
+    bool ReadEdge(uint32_t index, Ptr<T, Policy>* target, bool defer) {
+        constexpr bool weak = std::is_same_v<Ptr<T, Policy>, WeakPtr<T, Policy>>;
+        if (index == kGraphNull) {
+            return true;
+        }
+        if (index >= view_.EdgeCount()) {
+            throw GraphFormatError("Bad edge");
+        }
+        GraphFileEdge edge = view_.Edge(index);
+        if (static_cast<bool>(edge.flags & kGraphEdgeWeak) != weak) {
+            throw GraphFormatError("Edge is read as the wrong kind of pointer");
+        }
+        if (edge.node == kGraphNull) {
+            return true;
+        }
+        GraphFileNode node = view_.Node(edge.node);
+        if (edge.offset > node.object_size || sizeof(T) > node.object_size - edge.offset) {
+            throw GraphFormatError("Pointer reaches past its object");
+        }
+        // The edge was saved with the type of the object, the object has to be built as this one
+        uintptr_t type = (edge.flags & kGraphEdgeOwning) ? TypeTag<std::remove_cv_t<T>>() : 0;
+        Slot& slot = slots_[edge.node];
+        if constexpr (HasLoadNode<std::remove_cv_t<T>>::value) {
+            if (slot.block == nullptr && (edge.flags & kGraphEdgeOwning)) {
+                Materialize<std::remove_cv_t<T>, Policy>(edge.node);
+            }
+        }
+        if (slot.block == nullptr) {
+            if (defer) {
+                fixups_[edge.node].push_back(
+                    Fixup{target, edge.offset, &Assign<Ptr, T, Policy>, type});
+            }
+            return false;
+        }
+        CheckType(slot, type);
+        Assign<Ptr, T, Policy>(target, slot.object, edge.offset, slot.block);
+        return true;
+    }
+
+    // The declared size is checked before anything is allocated
+    template <typename T, typename Policy>
+    void Materialize(uint32_t node) {
+        static_assert(std::is_default_constructible_v<T>, "Loaded objects are value-initialized");
+        GraphFileNode entry = view_.Node(node);
+        if (entry.object_size != sizeof(T) || entry.object_align != alignof(T)) {
+            throw GraphFormatError("Object is read as a different type");
+        }
+        auto block = new ControlBlockEmplace<T>();
+        SharedPtr<T, Policy> owner(block->GetRawPtr(), block);
+        owner.ESFT();
+        Slot& slot = slots_[node];
+        slot.object = reinterpret_cast<char*>(block->GetRawPtr());
+        slot.block = owner.Detach();
+        slot.type = TypeTag<T>();
+        slot.load = &Load<T>;
+        slot.release = &Release<Policy>;
+        pending_.push_back(node);
+
+        auto it = fixups_.empty() ? fixups_.end() : fixups_.find(node);
+        if (it != fixups_.end()) {
+            for (const Fixup& fixup : it->second) {
+                CheckType(slot, fixup.type);
+                fixup.assign(fixup.target, slot.object, fixup.offset, slot.block);
+            }
+            fixups_.erase(it);
+        }
+    }
+
+    static void CheckType(const Slot& slot, uintptr_t type) {
+        if (type != 0 && type != slot.type) {
+            throw GraphFormatError("Object is read as a different type");
+        }
+    }
+
+    // Objects are created as soon as they are reached and filled in in that order, so long
+    // chains don't recurse. After an exception the objects still pending keep their
+    // value-initialized state
+    void LoadPending() {
+        try {
+            for (size_t i = 0; i < pending_.size(); ++i) {
+                uint32_t node = pending_[i];
+                payload_ = view_.Payload(node);
+                slots_[node].load(*this, slots_[node].object);
+            }
+        } catch (...) {
+            pending_.clear();
+            throw;
+        }
+        pending_.clear();
+    }
+
+    GraphView view_;
+    std::vector<Slot> slots_;
+    std::vector<uint32_t> pending_;
+    std::unordered_map<uint32_t, std::vector<Fixup>> fixups_;
+    GraphPayload payload_;
+};
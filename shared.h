@@ -2,98 +2,111 @@
 
 #include "sw_fwd.h"  // Forward declaration
 
+#include <algorithm>
 #include <cstddef>  // std::nullptr_t
+#include <cstdint>
+#include <stdexcept>
 #include <type_traits>
+#include <vector>
 
 
-template <typename T>
+template <typename T, typename Policy>
 class SharedPtr {
 public:
+    // `T` may be `U[]` or `U[N]`, the pointer then refers to the first element
+    using ElementType = std::remove_extent_t<T>;
+
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
     SharedPtr() : block_(nullptr), ptr_(nullptr) {
-        ESFT();
     }
     SharedPtr(std::nullptr_t) : block_(nullptr), ptr_(nullptr) {
-        ESFT();
     }
-    explicit SharedPtr(T* ptr) {
-        block_ = new ControlBlockPointer(ptr);
+    explicit SharedPtr(ElementType* ptr) {
+        block_ = new ControlBlockPointer<T>(ptr);
         ptr_ = ptr;
-        ESFT();
+        ESFTSeparate();
     }
 
     SharedPtr(const SharedPtr& other) {
         block_ = other.block_;
         ptr_ = other.ptr_;
         if (block_) {
-            block_->strong_cnt += 1;
+            block_->AddStrong<Policy>();
         }
-        ESFT();
     }
-    SharedPtr(SharedPtr&& other) {
+    SharedPtr(SharedPtr&& other) noexcept {
         block_ = other.block_;
         ptr_ = other.ptr_;
         other.block_ = nullptr;
         other.ptr_ = nullptr;
-        ESFT();
     }
 
     template <typename S>
     explicit SharedPtr(S* ptr) {
-        block_ = new ControlBlockPointer(ptr);
+        block_ = new ControlBlockPointer<S>(ptr);
         ptr_ = ptr;
-        ESFT();
+        ESFTSeparate();
     }
+    // Control block pointers are adopted by the constructor below, not treated as deleters
+    template <typename Deleter,
+              typename = std::enable_if_t<!std::is_convertible_v<Deleter, ControlBlockBase*>>>
+    SharedPtr(ElementType* ptr, Deleter deleter)
+        : SharedPtr(ptr, std::move(deleter), std::allocator<ElementType>()) {
+    }
+    template <typename Deleter, typename Alloc>
+    SharedPtr(ElementType* ptr, Deleter deleter, Alloc alloc) {
+        try {
+            block_ = AllocateControlBlock<ControlBlockDeleter<ElementType, Deleter, Alloc>>(
+                alloc, ptr, deleter);
+        } catch (...) {
+            deleter(ptr);
+            throw;
+        }
+        ptr_ = ptr;
+        ESFTSeparate();
+    }
+
     template <typename S>
-    SharedPtr(const SharedPtr<S>& other) {
+    SharedPtr(const SharedPtr<S, Policy>& other) {
         block_ = other.GetBlock();
         ptr_ = other.Get();
         if (block_) {
-            block_->strong_cnt += 1;
+            block_->AddStrong<Policy>();
         }
-        ESFT();
     }
+    // Takes over the reference of `other`, the counts are left alone
     template <typename S>
-    SharedPtr(SharedPtr<S>&& other) {
-        block_ = other.GetBlock();
+    SharedPtr(SharedPtr<S, Policy>&& other) noexcept {
         ptr_ = other.Get();
-        if (block_) {
-            block_->strong_cnt += 1;
-        }
-        other.Reset();
-        ESFT();
+        block_ = other.Detach();
     }
 
-    SharedPtr(T* ptr, ControlBlockEmplace<T>* block) {
+    // Adopts a reference that the caller already holds on `block`. `EnableSharedFromThis` is
+    // only set up where ownership is first established, so copies never write to the object
+    SharedPtr(ElementType* ptr, ControlBlockBase* block) {
         block_ = block;
         ptr_ = ptr;
-        ESFT();
     }
 
     // Aliasing constructor
     template <typename Y>
-    SharedPtr(const SharedPtr<Y>& other, T* ptr) {
+    SharedPtr(const SharedPtr<Y, Policy>& other, ElementType* ptr) {
         ptr_ = ptr;
         block_ = other.GetBlock();
         if (block_) {
-            block_->strong_cnt += 1;
+            block_->AddStrong<Policy>();
         }
-        ESFT();
     }
 
     // Promote `WeakPtr`
-    explicit SharedPtr(const WeakPtr<T>& other) {
-        if (other.Expired()) {
+    explicit SharedPtr(const WeakPtr<T, Policy>& other) {
+        block_ = other.GetBlock();
+        if (!block_ || !block_->TryAddStrong<Policy>()) {
             throw BadWeakPtr();
         }
-        block_ = other.GetBlock();
         ptr_ = other.Get();
-        if (block_) {
-            block_->strong_cnt += 1;
-        }
-        ESFT();
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -107,22 +120,14 @@ public:
         block_ = other.block_;
         ptr_ = other.ptr_;
         if (block_) {
-            block_->strong_cnt += 1;
+            block_->AddStrong<Policy>();
         }
         if (tmp) {
-            tmp->weak_cnt += 1;
-            tmp->strong_cnt -= 1;
-            if (tmp->strong_cnt == 0) {
-                tmp->Destroy();
-            }
-            tmp->weak_cnt -= 1;
-            if (tmp->strong_cnt == 0 && tmp->weak_cnt == 0) {
-                delete tmp;
-            }
+            tmp->ReleaseStrong<Policy>();
         }
         return *this;
     }
-    SharedPtr& operator=(SharedPtr&& other) {
+    SharedPtr& operator=(SharedPtr&& other) noexcept {
         if (this == &other) {
             return *this;
         }
@@ -132,15 +137,7 @@ public:
         other.block_ = nullptr;
         other.ptr_ = nullptr;
         if (tmp) {
-            tmp->weak_cnt += 1;
-            tmp->strong_cnt -= 1;
-            if (tmp->strong_cnt == 0) {
-                tmp->Destroy();
-            }
-            tmp->weak_cnt -= 1;
-            if (tmp->strong_cnt == 0 && tmp->weak_cnt == 0) {
-                delete tmp;
-            }
+            tmp->ReleaseStrong<Policy>();
         }
         return *this;
     }
@@ -150,15 +147,7 @@ public:
 
     ~SharedPtr() {
         if (block_) {
-            block_->weak_cnt += 1;
-            block_->strong_cnt -= 1;
-            if (block_->strong_cnt == 0) {
-                block_->Destroy();
-            }
-            block_->weak_cnt -= 1;
-            if (block_->strong_cnt == 0 && block_->weak_cnt == 0) {
-                delete block_;
-            }
+            block_->ReleaseStrong<Policy>();
         }
     }
 
@@ -170,34 +159,19 @@ public:
         block_ = nullptr;
         ptr_ = nullptr;
         if (old_block) {
-            old_block->weak_cnt += 1;
-            old_block->strong_cnt -= 1;
-            if (old_block->strong_cnt == 0) {
-                old_block->Destroy();
-            }
-            old_block->weak_cnt -= 1;
-            if (old_block->strong_cnt == 0 && old_block->weak_cnt == 0) {
-                delete old_block;
-            }
+            old_block->ReleaseStrong<Policy>();
         }
     }
-    void Reset(T* ptr) {
+    void Reset(ElementType* ptr) {
         if (ptr_ == ptr) {
             return;
         }
         auto old_block = block_;
-        block_ = new ControlBlockPointer(ptr);
+        block_ = new ControlBlockPointer<T>(ptr);
         ptr_ = ptr;
+        ESFTSeparate();
         if (old_block) {
-            old_block->weak_cnt += 1;
-            old_block->strong_cnt -= 1;
-            if (old_block->strong_cnt == 0) {
-                old_block->Destroy();
-            }
-            old_block->weak_cnt -= 1;
-            if (old_block->strong_cnt == 0 && old_block->weak_cnt == 0) {
-                delete old_block;
-            }
+            old_block->ReleaseStrong<Policy>();
         }
     }
     template <typename S>
@@ -206,21 +180,22 @@ public:
             return;
         }
         auto old_block = block_;
-        block_ = new ControlBlockPointer(ptr);
+        block_ = new ControlBlockPointer<S>(ptr);
         ptr_ = ptr;
+        ESFTSeparate();
         if (old_block) {
-            old_block->weak_cnt += 1;
-            old_block->strong_cnt -= 1;
-            if (old_block->strong_cnt == 0) {
-                old_block->Destroy();
-            }
-            old_block->weak_cnt -= 1;
-            if (old_block->strong_cnt == 0 && old_block->weak_cnt == 0) {
-                delete old_block;
-            }
+            old_block->ReleaseStrong<Policy>();
         }
     }
-    void Swap(SharedPtr& other) {
+    template <typename Deleter>
+    void Reset(ElementType* ptr, Deleter deleter) {
+        SharedPtr(ptr, std::move(deleter)).Swap(*this);
+    }
+    template <typename Deleter, typename Alloc>
+    void Reset(ElementType* ptr, Deleter deleter, Alloc alloc) {
+        SharedPtr(ptr, std::move(deleter), std::move(alloc)).Swap(*this);
+    }
+    void Swap(SharedPtr& other) noexcept {
         auto tmp = block_;
         auto tmp_ptr = ptr_;
         block_ = other.block_;
@@ -228,6 +203,13 @@ public:
         other.block_ = tmp;
         other.ptr_ = tmp_ptr;
     }
+    // Gives up the reference without decrementing the count, the caller releases `block`
+    ControlBlockBase* Detach() noexcept {
+        auto block = block_;
+        block_ = nullptr;
+        ptr_ = nullptr;
+        return block;
+    }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
@@ -235,21 +217,33 @@ public:
     ControlBlockBase* GetBlock() const {
         return block_;
     }
-    T* Get() const {
+    // Returns nullptr unless the object was given a deleter of type exactly `Deleter`
+    template <typename Deleter>
+    Deleter* GetDeleter() const {
+        if (!block_) {
+            return nullptr;
+        }
+        return static_cast<Deleter*>(reinterpret_cast<void*>(
+            block_->Dispatch(ControlBlockOp::kGetDeleter, TypeTag<Deleter>())));
+    }
+    ElementType* Get() const {
         if (ptr_) {
             return ptr_;
         }
         return nullptr;
     }
-    T& operator*() const {
+    ElementType& operator*() const {
         return *ptr_;
     }
-    T* operator->() const {
+    ElementType* operator->() const {
         return ptr_;
     }
+    ElementType& operator[](ptrdiff_t index) const {
+        return ptr_[index];
+    }
     size_t UseCount() const {
         if (block_) {
-            return block_->strong_cnt;
+            return block_->StrongCount<Policy>();
         }
         return 0;
     }
@@ -260,50 +254,304 @@ public:
         return false;
     }
 
+    // Sets up `EnableSharedFromThis` for a block that holds the object
     void ESFT() {
-        if constexpr (std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
-            InitWeakThis(ptr_);
+        if constexpr (!std::is_array_v<T> &&
+                      std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+            if (ptr_) {
+                InitWeakThis(ptr_, false);
+            }
         }
     }
-    template <typename Y>
-    void InitWeakThis(EnableSharedFromThis<Y>* e) {
-        e->weak_this_ = *this;
+    // Same for a block that only points to the object, which may outlive it
+    void ESFTSeparate() {
+        if constexpr (!std::is_array_v<T> &&
+                      std::is_convertible_v<T*, EnableSharedFromThisBase*>) {
+            if (ptr_) {
+                InitWeakThis(ptr_, true);
+            }
+        }
+    }
+    template <typename Y, typename P>
+    void InitWeakThis(EnableSharedFromThis<Y, P>* e, bool separate) {
+        e->SetOwner(block_, separate);
     }
 
 private:
     ControlBlockBase* block_;
-    T* ptr_;
+    ElementType* ptr_;
 };
 
-template <typename T, typename U>
-inline bool operator==(const SharedPtr<T>& left, const SharedPtr<U>& right) {
+// Owns its reference through plain pointers, so its bytes can be moved
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<SharedPtr<T, Policy>> : std::true_type {};
+
+template <typename T, typename P, typename U, typename Q>
+inline bool operator==(const SharedPtr<T, P>& left, const SharedPtr<U, Q>& right) {
     return left.Get() == right.Get();
 }
 
+// Writes `n` copies of `ptr` to `out` with a single update of the strong count. Throws
+// `std::length_error` before writing anything if the count would reach
+// `ControlBlockBase::kImmortal`
+template <typename T, typename Policy, typename OutputIt>
+OutputIt ShareN(const SharedPtr<T, Policy>& ptr, size_t n, OutputIt out) {
+    ControlBlockBase* block = ptr.GetBlock();
+    if (block == nullptr || n == 0) {
+        for (size_t i = 0; i < n; ++i) {
+            *out++ = SharedPtr<T, Policy>();
+        }
+        return out;
+    }
+    if (!block->StrongFits<Policy>(n)) {
+        throw std::length_error("Too many references for one control block");
+    }
+    block->AddStrong<Policy>(n);
+    size_t issued = 0;
+    try {
+        while (issued < n) {
+            SharedPtr<T, Policy> copy(ptr.Get(), block);
+            ++issued;
+            *out++ = std::move(copy);
+        }
+    } catch (...) {
+        if (issued < n) {
+            block->ReleaseStrong<Policy>(n - issued);
+        }
+        throw;
+    }
+    return out;
+}
 
-template <typename T, typename... Args>
-SharedPtr<T> MakeShared(Args&&... args) {
-    auto block = new ControlBlockEmplace<T>(std::forward<Args>(args)...);
-    return SharedPtr<T>(block->GetRawPtr(), block);
+// Resets `count` pointers with one decrement per distinct control block. Throws only if the
+// grouping buffer can't be allocated, the pointers are left untouched then
+template <typename T, typename Policy>
+void ReleaseBatch(SharedPtr<T, Policy>* ptrs, size_t count) {
+    std::vector<ControlBlockBase*> blocks;
+    blocks.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (ControlBlockBase* block = ptrs[i].Detach()) {
+            blocks.push_back(block);
+        }
+    }
+    std::sort(blocks.begin(), blocks.end());
+    for (size_t begin = 0; begin < blocks.size();) {
+        size_t end = begin + 1;
+        while (end < blocks.size() && blocks[end] == blocks[begin]) {
+            ++end;
+        }
+        blocks[begin]->ReleaseStrong<Policy>(end - begin);
+        begin = end;
+    }
 }
 
+// Objects of at least this size are placed out of line by `MakeShared`, so that `WeakPtr`s don't
+// pin their memory once they are destroyed. Disabled unless configured. The value has to be the
+// same in every translation unit, otherwise `MakeShared<T>` differs between them; to choose the
+// layout of a single type, specialize `StoreSeparately` in the header that defines it instead
+#ifdef SW_PTR_SEPARATE_STORAGE_THRESHOLD
+inline constexpr size_t kSeparateStorageThreshold = SW_PTR_SEPARATE_STORAGE_THRESHOLD;
+#else
+inline constexpr size_t kSeparateStorageThreshold = SIZE_MAX;
+#endif
 
+// May be specialized to choose the layout of `MakeShared<T>` per type, visibly to every user of
+// `MakeShared<T>`
 template <typename T>
+struct StoreSeparately : std::bool_constant<sizeof(T) >= kSeparateStorageThreshold> {};
+
+// Takes over a freshly allocated object, deleting it if the block can't be allocated
+template <typename T, typename Policy>
+SharedPtr<T, Policy> AdoptSeparate(T* ptr) {
+    ControlBlockBase* block;
+    try {
+        block = new ControlBlockPointer<T>(ptr);
+    } catch (...) {
+        delete ptr;
+        throw;
+    }
+    SharedPtr<T, Policy> result(ptr, block);
+    result.ESFTSeparate();
+    return result;
+}
+
+// Like `MakeShared`, but the object gets its own allocation, which is freed as soon as the last
+// strong reference is gone
+template <typename T, typename Policy = NonAtomicRefCount, typename... Args>
+SharedPtr<T, Policy> MakeSharedSeparate(Args&&... args) {
+    static_assert(!std::is_array_v<T>);
+    return AdoptSeparate<T, Policy>(new T{std::forward<Args>(args)...});
+}
+
+// Elements are copies of `value`, or value-initialized if there is none
+template <typename T, typename Policy, typename... Value>
+SharedPtr<T, Policy> MakeSharedArray(size_t size, const Value&... value) {
+    using E = std::remove_extent_t<T>;
+    auto block = ControlBlockArray<E>::Create(size, [&](E* ptr) { new (ptr) E(value...); });
+    return SharedPtr<T, Policy>(block->GetRawPtr(), block);
+}
+
+// For arrays: `MakeShared<T[]>(size[, value])` and `MakeShared<T[N]>([value])`
+template <typename T, typename Policy = NonAtomicRefCount, typename... Args>
+SharedPtr<T, Policy> MakeShared(Args&&... args) {
+    if constexpr (std::is_array_v<T>) {
+        if constexpr (std::extent_v<T> == 0) {
+            return MakeSharedArray<T, Policy>(args...);
+        } else {
+            return MakeSharedArray<T, Policy>(std::extent_v<T>, args...);
+        }
+    } else if constexpr (StoreSeparately<T>::value) {
+        return MakeSharedSeparate<T, Policy>(std::forward<Args>(args)...);
+    } else {
+        auto block = new ControlBlockEmplace<T>(std::forward<Args>(args)...);
+        SharedPtr<T, Policy> result(block->GetRawPtr(), block);
+        result.ESFT();
+        return result;
+    }
+}
+
+// Same as `MakeShared`, but default-initializes, so trivial types are left uninitialized.
+// For arrays: `MakeSharedForOverwrite<T[]>(size)` and `MakeSharedForOverwrite<T[N]>()`
+template <typename T, typename Policy = NonAtomicRefCount, typename... Size>
+SharedPtr<T, Policy> MakeSharedForOverwrite(Size... size) {
+    if constexpr (std::is_array_v<T>) {
+        using E = std::remove_extent_t<T>;
+        static_assert(sizeof...(Size) == (std::extent_v<T> == 0 ? 1 : 0));
+        auto block = ControlBlockArray<E>::Create(std::extent_v<T> + (size_t{0} + ... + size),
+                                                  [](E* ptr) { new (ptr) E; });
+        return SharedPtr<T, Policy>(block->GetRawPtr(), block);
+    } else if constexpr (StoreSeparately<T>::value) {
+        static_assert(sizeof...(Size) == 0);
+        return AdoptSeparate<T, Policy>(new T);
+    } else {
+        static_assert(sizeof...(Size) == 0);
+        auto block = new ControlBlockEmplace<T>(ForOverwriteTag{});
+        SharedPtr<T, Policy> result(block->GetRawPtr(), block);
+        result.ESFT();
+        return result;
+    }
+}
+
+template <typename T, typename Policy = NonAtomicRefCount, typename Alloc, typename... Args>
+SharedPtr<T, Policy> AllocateShared(const Alloc& alloc, Args&&... args) {
+    auto block = AllocateControlBlock<ControlBlockAllocate<T, Alloc>>(alloc,
+                                                                      std::forward<Args>(args)...);
+    SharedPtr<T, Policy> result(block->GetRawPtr(), block);
+    result.ESFT();
+    return result;
+}
+
+// The object is never destroyed and its block is never freed. Copies, resets and weak references
+// of the result leave the counts alone, so it can be shared between threads without contention
+template <typename T, typename Policy = NonAtomicRefCount, typename... Args>
+SharedPtr<T, Policy> MakeImmortalShared(Args&&... args) {
+    static_assert(!std::is_array_v<T>);
+    auto block = new ControlBlockEmplace<T>(std::forward<Args>(args)...);
+    block->counts.store(ControlBlockBase::kImmortal | ControlBlockBase::kWeakOne,
+                        std::memory_order_relaxed);
+    SharedPtr<T, Policy> result(block->GetRawPtr(), block);
+    result.ESFT();
+    return result;
+}
+
+// Shares an object that outlives all pointers to it, e.g. a static, without owning it
+template <typename T, typename Policy = NonAtomicRefCount>
+SharedPtr<T, Policy> AdoptImmortal(T& object) {
+    SharedPtr<T, Policy> result(&object, ControlBlockImmortal::Instance());
+    result.ESFT();
+    return result;
+}
+
+
+// Remembers the control block of the first owner that is still alive. A block that holds the
+// object outlives it, so no reference is needed; on a block that only points to the object, the
+// object keeps a weak reference until it is destroyed. Empty pointers are returned before the
+// object is owned and once the owners are gone or its destruction has begun.
+//
+// The object may be owned by pointers of any policy; `Policy` only sets the default for the
+// pointers handed out here, which have to use the owners' policy if those are shared between
+// threads
+template <typename T, typename Policy>
 class EnableSharedFromThis : public EnableSharedFromThisBase {
 public:
-    SharedPtr<T> SharedFromThis() {
-        return weak_this_.Lock();
+    EnableSharedFromThis() noexcept : block_this_(nullptr), holds_weak_(false) {
+    }
+    // A copy is a new object without an owner
+    EnableSharedFromThis(const EnableSharedFromThis&) noexcept
+        : block_this_(nullptr), holds_weak_(false) {
+    }
+    EnableSharedFromThis& operator=(const EnableSharedFromThis&) noexcept {
+        return *this;
+    }
+
+    ~EnableSharedFromThis() {
+        DropOwner();
+    }
+
+    template <typename P = Policy>
+    SharedPtr<T, P> SharedFromThis() {
+        if (block_this_ && block_this_->TryAddStrong<P>()) {
+            return SharedPtr<T, P>(static_cast<T*>(this), block_this_);
+        }
+        return SharedPtr<T, P>();
+    }
+    template <typename P = Policy>
+    SharedPtr<const T, P> SharedFromThis() const {
+        if (block_this_ && block_this_->TryAddStrong<P>()) {
+            return SharedPtr<const T, P>(static_cast<const T*>(this), block_this_);
+        }
+        return SharedPtr<const T, P>();
     }
-    SharedPtr<const T> SharedFromThis() const {
-        return weak_this_.Lock();
+
+    // A block that holds the object may be freed right after the object is destroyed, so it is
+    // not handed out once that has begun
+    template <typename P = Policy>
+    WeakPtr<T, P> WeakFromThis() noexcept {
+        if (!Owned()) {
+            return WeakPtr<T, P>();
+        }
+        block_this_->AddWeak<P>();
+        return WeakPtr<T, P>(static_cast<T*>(this), block_this_);
+    }
+    template <typename P = Policy>
+    WeakPtr<const T, P> WeakFromThis() const noexcept {
+        if (!Owned()) {
+            return WeakPtr<const T, P>();
+        }
+        block_this_->AddWeak<P>();
+        return WeakPtr<const T, P>(static_cast<const T*>(this), block_this_);
+    }
+
+private:
+    template <typename U, typename P>
+    friend class SharedPtr;
+
+    bool Owned() const noexcept {
+        return block_this_ && block_this_->StrongCount<Policy>() != 0;
     }
 
-    WeakPtr<T> WeakFromThis() noexcept {
-        return weak_this_;
+    // A later owner, e.g. `AdoptImmortal` of an object that is already shared, doesn't replace a
+    // live one. The weak reference is taken atomically, since the owners' policy isn't known
+    // when it is released
+    void SetOwner(ControlBlockBase* block, bool separate) {
+        if (Owned()) {
+            return;
+        }
+        DropOwner();
+        if (separate) {
+            block->AddWeak<AtomicRefCount>();
+        }
+        block_this_ = block;
+        holds_weak_ = separate;
     }
-    WeakPtr<const T> WeakFromThis() const noexcept {
-        return weak_this_;
+    void DropOwner() {
+        if (holds_weak_) {
+            holds_weak_ = false;
+            block_this_->ReleaseWeak<AtomicRefCount>();
+        }
+        block_this_ = nullptr;
     }
 
-    WeakPtr<T> weak_this_;
+    ControlBlockBase* block_this_;
+    bool holds_weak_;
 };
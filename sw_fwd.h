@@ -1,35 +1,326 @@
 #pragma once
 
+#include "compressed_pair.h"
+#include "instrument.h"
+#include "lifetime.h"
+#include "ref_count.h"
+#include "relocation.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <exception>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+enum class ControlBlockOp {
+    kDestroy,
+    kDeallocate,
+    kDestroyAndDeallocate,
+    // Only sent to blocks with `kCustomCount`
+    kAddStrong,
+    kTryAddStrong,
+    kReleaseStrong,
+    kStrongCount,
+    // `arg` is `TypeTag<Deleter>()`, returns a pointer to the stored deleter or zero
+    kGetDeleter,
+    // Returns the address of the owned object, zero for blocks that don't own a single one
+    kGetObject,
+    // Returns `TypeTag` of the owned object's type for blocks that constructed it, zero for
+    // blocks that were handed a pointer and only know its static type
+    kGetObjectType,
+};
+
+// Unique per type without relying on RTTI
+template <typename T>
+uintptr_t TypeTag() {
+    static const char tag = 0;
+    return reinterpret_cast<uintptr_t>(&tag);
+}
+
+struct ControlBlockBase;
+
+#ifdef SW_PTR_BLOCK_REGISTRY
+// Defined in registry.h, which is included at the end of this file
+struct BlockTypeInfo;
+template <typename T>
+const BlockTypeInfo* BlockTypeInfoOf();
+inline void RegisterControlBlock(ControlBlockBase* block, const BlockTypeInfo* type);
+inline void UnregisterControlBlock(ControlBlockBase* block);
+
+#define SW_PTR_REGISTER_BLOCK(T) RegisterControlBlock(this, BlockTypeInfoOf<T>())
+#define SW_PTR_MARK_DESTROYED(block) (block)->destroyed.store(true, std::memory_order_relaxed)
+#define SW_PTR_UNREGISTER_BLOCK(block) UnregisterControlBlock(block)
+#else
+#define SW_PTR_REGISTER_BLOCK(T) \
+    do {                         \
+    } while (false)
+#define SW_PTR_MARK_DESTROYED(block) \
+    do {                             \
+    } while (false)
+#define SW_PTR_UNREGISTER_BLOCK(block) \
+    do {                               \
+    } while (false)
+#endif
+
+// Called from a block constructor once the object of type `T` is constructed
+#define SW_PTR_BLOCK_CREATED(T)     \
+    do {                            \
+        SW_PTR_INSTRUMENT_BLOCK(T); \
+        SW_PTR_REGISTER_BLOCK(T);   \
+    } while (false)
+
+// Installed by `DeferredDestructionScope` (see deferred.h): takes over blocks whose last strong
+// reference is dropped on this thread. `exclusive` means that no weak references are left.
+// Returns false if the block has to be released inline
+using DeferredReleaseHook = bool (*)(ControlBlockBase* block, bool exclusive);
+
+inline DeferredReleaseHook& CurrentDeferredReleaseHook() {
+    thread_local DeferredReleaseHook hook = nullptr;
+    return hook;
+}
+
+// One function per block type replaces the vtable: `kDestroy` ends the lifetime of the object,
+// `kDeallocate` frees the block itself
+using ControlBlockManager = uintptr_t (*)(ControlBlockBase* block, ControlBlockOp op,
+                                          uintptr_t arg);
 
 struct ControlBlockBase {
-    size_t strong_cnt = 1;
-    size_t weak_cnt = 0;
+    // Strong count lives in the low half of `counts`, weak count in the high half
+    static constexpr uint64_t kStrongOne = 1;
+    static constexpr uint64_t kWeakOne = uint64_t{1} << 32;
+    static constexpr uint64_t kStrongMask = kWeakOne - 1;
+    // Set in the strong half of blocks that keep the strong count themselves (see biased.h)
+    static constexpr uint64_t kCustomCount = uint64_t{1} << 31;
+    // Set in the strong half of blocks that are never released (see `MakeImmortalShared`). Such
+    // blocks ignore all count updates and report this as their use count
+    static constexpr uint64_t kImmortal = uint64_t{1} << 30;
+    // Tested together, so ordinary blocks pay for one branch only
+    static constexpr uint64_t kSpecialCount = kCustomCount | kImmortal;
 
-    virtual void Destroy(){};
+    // Strong owners collectively hold one weak reference, so the block survives `kDestroy`
+    std::atomic<uint64_t> counts{kStrongOne | kWeakOne};
+    ControlBlockManager manager = nullptr;
+#ifdef SW_PTR_INSTRUMENTATION
+    // Set by `SW_PTR_BLOCK_CREATED`, blocks without it are not counted
+    TypeStats* stats = nullptr;
+#endif
+#ifdef SW_PTR_BLOCK_REGISTRY
+    // Maintained by `BlockRegistry`, blocks without a type are not registered
+    const BlockTypeInfo* registry_type = nullptr;
+    ControlBlockBase* registry_prev = nullptr;
+    ControlBlockBase* registry_next = nullptr;
+    size_t registry_shard = 0;
+    std::atomic<bool> destroyed{false};
+#endif
 
-    virtual ~ControlBlockBase() = default;
+    uintptr_t Dispatch(ControlBlockOp op, uintptr_t arg = 0) {
+        return manager(this, op, arg);
+    }
+
+    template <typename Policy>
+    void AddStrong(size_t cnt = 1) {
+        SW_PTR_RECORD(stats, kStrongIncrement, cnt);
+        uint64_t old = Policy::Load(counts);
+        if (old & kSpecialCount) {
+            AddStrongSpecial(cnt);
+            return;
+        }
+        // The flags start right above the usable part of the strong half
+        assert(cnt < kImmortal - (old & kStrongMask));
+        Policy::Add(counts, cnt);
+    }
+    template <typename Policy>
+    void AddWeak() {
+        SW_PTR_RECORD(stats, kWeakIncrement, 1);
+        if (Policy::Load(counts) & kImmortal) {
+            return;
+        }
+        Policy::Add(counts, kWeakOne);
+    }
+    // Used to promote weak references: never resurrects an object that is already destroyed
+    template <typename Policy>
+    bool TryAddStrong() {
+        uint64_t cnt = Policy::Load(counts);
+        if (cnt & kSpecialCount) {
+            if (!(cnt & kImmortal) && !Dispatch(ControlBlockOp::kTryAddStrong)) {
+                return false;
+            }
+            SW_PTR_RECORD(stats, kStrongIncrement, 1);
+            return true;
+        }
+        while (cnt & kStrongMask) {
+            if (Policy::CompareExchange(counts, cnt, cnt + kStrongOne)) {
+                SW_PTR_RECORD(stats, kStrongIncrement, 1);
+                return true;
+            }
+        }
+        return false;
+    }
+    template <typename Policy>
+    void ReleaseStrong(size_t cnt = 1) {
+        SW_PTR_RECORD(stats, kStrongDecrement, cnt);
+        if (Policy::Load(counts) & kSpecialCount) {
+            if (ReleaseStrongSpecial(cnt)) {
+                ReleaseObject<Policy>(Policy::Load(counts));
+            }
+            return;
+        }
+        uint64_t old = Policy::FetchSub(counts, cnt);
+        if ((old & kStrongMask) == cnt) {
+            Policy::AcquireFence();
+            ReleaseObject<Policy>(old);
+        }
+    }
+    template <typename Policy>
+    void ReleaseWeak() {
+        SW_PTR_RECORD(stats, kWeakDecrement, 1);
+        if (Policy::Load(counts) & kImmortal) {
+            return;
+        }
+        if (Policy::FetchSub(counts, kWeakOne) / kWeakOne == 1) {
+            Policy::AcquireFence();
+            Dispatch(ControlBlockOp::kDeallocate);
+        }
+    }
+    // Whether `cnt` more strong references can be added without reaching the flags
+    template <typename Policy>
+    bool StrongFits(size_t cnt) {
+        uint64_t old = Policy::Load(counts);
+        return (old & kSpecialCount) || cnt < kImmortal - (old & kStrongMask);
+    }
+    template <typename Policy>
+    size_t StrongCount() {
+        uint64_t cnt = Policy::Load(counts);
+        if (cnt & kSpecialCount) {
+            return cnt & kImmortal ? kImmortal : Dispatch(ControlBlockOp::kStrongCount);
+        }
+        return cnt & kStrongMask;
+    }
+
+    // Slow paths of blocks with `kSpecialCount`, kept out of the inlined fast paths. Returns true
+    // if the last strong reference is gone
+    void AddStrongSpecial(size_t cnt) {
+        if (!(counts.load(std::memory_order_relaxed) & kImmortal)) {
+            Dispatch(ControlBlockOp::kAddStrong, cnt);
+        }
+    }
+    bool ReleaseStrongSpecial(size_t cnt) {
+        if (counts.load(std::memory_order_relaxed) & kImmortal) {
+            return false;
+        }
+        return Dispatch(ControlBlockOp::kReleaseStrong, cnt);
+    }
+
+    // Called after the last strong reference is gone with the counts seen at that moment. If
+    // only the implicit weak reference is left, nobody else can reach the block any more and
+    // both halves of the release are done with one call
+    template <typename Policy>
+    void ReleaseObject(uint64_t cnt) {
+        // Only thread-safe counts may be released on another thread
+        if constexpr (Policy::kThreadSafe) {
+            DeferredReleaseHook hook = CurrentDeferredReleaseHook();
+            if (hook && hook(this, cnt / kWeakOne == 1)) {
+                return;
+            }
+        }
+        if (cnt / kWeakOne == 1) {
+            Dispatch(ControlBlockOp::kDestroyAndDeallocate);
+            return;
+        }
+        Dispatch(ControlBlockOp::kDestroy);
+        ReleaseWeak<Policy>();
+    }
+
+    // Counting ops for blocks with `kCustomCount`, shadowed by such blocks
+    uintptr_t CustomCount(ControlBlockOp, uintptr_t) {
+        return 0;
+    }
+    // Shadowed by blocks that store a deleter
+    void* FindDeleter(uintptr_t) {
+        return nullptr;
+    }
+    // Shadowed by blocks that know where their object is
+    const void* FindObject() {
+        return nullptr;
+    }
+    // Shadowed by blocks that constructed their object
+    uintptr_t FindObjectType() {
+        return 0;
+    }
 };
 
+// Manager of `Block`. Calls are resolved statically, so every concrete block type has to
+// declare its own `Deallocate()`
+template <typename Block>
+uintptr_t ManageControlBlock(ControlBlockBase* base, ControlBlockOp op, uintptr_t arg) {
+    auto block = static_cast<Block*>(base);
+    switch (op) {
+        case ControlBlockOp::kDestroy:
+            SW_PTR_RECORD(block->stats, kDestroy, 1);
+            SW_PTR_RECORD_WEAK_ONLY(block->stats, static_cast<int64_t>(sizeof(Block)));
+            SW_PTR_MARK_DESTROYED(block);
+            block->Destroy();
+            return 0;
+        case ControlBlockOp::kDeallocate:
+            SW_PTR_RECORD_WEAK_ONLY(block->stats, -static_cast<int64_t>(sizeof(Block)));
+            SW_PTR_UNREGISTER_BLOCK(block);
+            block->Deallocate();
+            return 0;
+        case ControlBlockOp::kDestroyAndDeallocate:
+            SW_PTR_RECORD(block->stats, kDestroy, 1);
+            SW_PTR_UNREGISTER_BLOCK(block);
+            block->Destroy();
+            block->Deallocate();
+            return 0;
+        case ControlBlockOp::kGetDeleter:
+            return reinterpret_cast<uintptr_t>(block->FindDeleter(arg));
+        case ControlBlockOp::kGetObject:
+            return reinterpret_cast<uintptr_t>(block->FindObject());
+        case ControlBlockOp::kGetObjectType:
+            return block->FindObjectType();
+        default:
+            return block->CustomCount(op, arg);
+    }
+}
+
+// `T` may be an array type, the pointer then comes from `new[]`
 template <typename T>
 struct ControlBlockPointer : public ControlBlockBase {
-    explicit ControlBlockPointer(T* ptr) : ptr(ptr) {
+    explicit ControlBlockPointer(std::remove_extent_t<T>* ptr) : ptr(ptr) {
+        manager = &ManageControlBlock<ControlBlockPointer>;
+        SW_PTR_BLOCK_CREATED(T);
     }
 
-    void Destroy() override {
-        delete ptr;
+    void Destroy() {
+        if constexpr (std::is_array_v<T>) {
+            delete[] ptr;
+        } else {
+            delete ptr;
+        }
     }
-
-    ~ControlBlockPointer() override {
+    void Deallocate() {
+        delete this;
+    }
+    const void* FindObject() {
+        return ptr;
     }
 
-    T* ptr;
+    std::remove_extent_t<T>* ptr;
 };
 
-template <typename T>
-struct ControlBlockEmplace : public ControlBlockBase {
+// Requests default-initialization: the object is left as is instead of being zeroed by `T{}`
+struct ForOverwriteTag {};
+
+// Object stored inside the block, right after the members of `Base`. Concrete blocks derive from
+// it, emplace the object and declare their own `Deallocate()`
+template <typename T, typename Base = ControlBlockBase>
+struct ControlBlockInline : public Base {
     template <typename... Args>
-    ControlBlockEmplace(Args&&... args) {
+    void Emplace(Args&&... args) {
         new (&storage) T{std::forward<Args>(args)...};
     }
 
@@ -37,25 +328,236 @@ struct ControlBlockEmplace : public ControlBlockBase {
         return reinterpret_cast<T*>(&storage);
     }
 
-    void Destroy() override {
+    void Destroy() {
         GetRawPtr()->~T();
     }
-
-    ~ControlBlockEmplace() override {
+    const void* FindObject() {
+        return GetRawPtr();
+    }
+    uintptr_t FindObjectType() {
+        return TypeTag<std::remove_cv_t<T>>();
     }
 
     std::aligned_storage_t<sizeof(T), alignof(T)> storage;
 };
 
-class EnableSharedFromThisBase {};
+template <typename T>
+struct ControlBlockEmplace : public ControlBlockInline<T> {
+    template <typename... Args>
+    ControlBlockEmplace(Args&&... args) {
+        this->manager = &ManageControlBlock<ControlBlockEmplace>;
+        this->Emplace(std::forward<Args>(args)...);
+        SW_PTR_BLOCK_CREATED(T);
+    }
+    explicit ControlBlockEmplace(ForOverwriteTag) {
+        this->manager = &ManageControlBlock<ControlBlockEmplace>;
+        new (&this->storage) T;
+        SW_PTR_BLOCK_CREATED(T);
+    }
 
+    void Deallocate() {
+        delete this;
+    }
+};
+
+// Base of blocks followed by their object, or their elements, of type `T` in the same
+// allocation. `Block` is the concrete block type
+template <typename Block, typename T>
+struct ControlBlockTrailing : public ControlBlockBase {
+    T* GetRawPtr() {
+        return reinterpret_cast<T*>(reinterpret_cast<char*>(static_cast<Block*>(this)) +
+                                    HeaderSize());
+    }
+    static Block* FromObject(T* ptr) {
+        return reinterpret_cast<Block*>(reinterpret_cast<char*>(ptr) - HeaderSize());
+    }
+
+    // `Block` padded so that a `T` can follow it
+    static constexpr size_t HeaderSize() {
+        return (sizeof(Block) + alignof(T) - 1) / alignof(T) * alignof(T);
+    }
+    static void* AllocateMemory(size_t bytes) {
+        if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            return ::operator new(bytes, std::align_val_t(alignof(T)));
+        } else {
+            return ::operator new(bytes);
+        }
+    }
+    // Called by `Deallocate()` once the block is destroyed
+    static void FreeMemory(Block* block) {
+        if constexpr (alignof(T) > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+            ::operator delete(block, std::align_val_t(alignof(T)));
+        } else {
+            ::operator delete(block);
+        }
+    }
+};
+
+// Array of `size` elements placed right after the block in the same allocation
 template <typename T>
+struct ControlBlockArray : public ControlBlockTrailing<ControlBlockArray<T>, T> {
+    static_assert(!std::is_array_v<T>, "Only one-dimensional arrays are supported");
+
+    explicit ControlBlockArray(size_t size) : size(size) {
+        this->manager = &ManageControlBlock<ControlBlockArray>;
+    }
+
+    // `init(ptr)` constructs one element at `ptr`
+    template <typename Init>
+    static ControlBlockArray* Create(size_t size, Init init) {
+        constexpr size_t header = ControlBlockArray::HeaderSize();
+        if (size > (SIZE_MAX - header) / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        auto block = new (ControlBlockArray::AllocateMemory(header + size * sizeof(T)))
+            ControlBlockArray(size);
+        T* elements = block->GetRawPtr();
+        size_t constructed = 0;
+        try {
+            for (; constructed < size; ++constructed) {
+                init(elements + constructed);
+            }
+        } catch (...) {
+            block->size = constructed;
+            block->Destroy();
+            block->Deallocate();
+            throw;
+        }
+        block->OnCreated();
+        return block;
+    }
+
+    void OnCreated() {
+        SW_PTR_BLOCK_CREATED(T[]);
+    }
+
+    void Destroy() {
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            T* elements = this->GetRawPtr();
+            for (size_t i = size; i > 0; --i) {
+                elements[i - 1].~T();
+            }
+        }
+    }
+    void Deallocate() {
+        this->~ControlBlockArray();
+        ControlBlockArray::FreeMemory(this);
+    }
+    const void* FindObject() {
+        return this->GetRawPtr();
+    }
+
+    size_t size;
+};
+
+// Allocates and constructs a control block through `alloc` rebound to the block type
+template <typename Block, typename Alloc, typename... Args>
+Block* AllocateControlBlock(const Alloc& alloc, Args&&... args) {
+    using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+    BlockAlloc block_alloc(alloc);
+    Block* block = std::allocator_traits<BlockAlloc>::allocate(block_alloc, 1);
+    try {
+        new (block) Block(alloc, std::forward<Args>(args)...);
+    } catch (...) {
+        std::allocator_traits<BlockAlloc>::deallocate(block_alloc, block, 1);
+        throw;
+    }
+    return block;
+}
+
+// Counterpart of `AllocateControlBlock`, called from `Deallocate()`
+template <typename Block, typename Alloc>
+void DeallocateControlBlock(Block* block, const Alloc& alloc) {
+    using BlockAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Block>;
+    BlockAlloc block_alloc(alloc);
+    block->~Block();
+    std::allocator_traits<BlockAlloc>::deallocate(block_alloc, block, 1);
+}
+
+// Object emplaced next to the counts, memory comes from `Alloc`. An empty allocator takes no
+// space thanks to `CompressedPairElement`
+template <typename T, typename Alloc>
+struct ControlBlockAllocate : public ControlBlockEmplace<T>,
+                              private CompressedPairElement<Alloc, 0> {
+    template <typename... Args>
+    ControlBlockAllocate(const Alloc& alloc, Args&&... args)
+        : ControlBlockEmplace<T>(std::forward<Args>(args)...),
+          CompressedPairElement<Alloc, 0>(Alloc(alloc)) {
+        this->manager = &ManageControlBlock<ControlBlockAllocate>;
+    }
+
+    void Deallocate() {
+        Alloc alloc(this->GetElement());
+        DeallocateControlBlock(this, alloc);
+    }
+};
+
+// Externally allocated object released with `Deleter`, block memory comes from `Alloc`. The
+// deleter and the allocator are stored inline; empty ones take no space
+template <typename T, typename Deleter, typename Alloc>
+struct ControlBlockDeleter : public ControlBlockBase {
+    ControlBlockDeleter(const Alloc& alloc, T* ptr, Deleter deleter)
+        : data(std::move(ptr), CompressedPair<Deleter, Alloc>(std::move(deleter), Alloc(alloc))) {
+        manager = &ManageControlBlock<ControlBlockDeleter>;
+        SW_PTR_BLOCK_CREATED(T);
+    }
+
+    Deleter& GetDeleter() {
+        return data.GetSecond().GetFirst();
+    }
+
+    void Destroy() {
+        GetDeleter()(data.GetFirst());
+    }
+    void Deallocate() {
+        Alloc alloc(data.GetSecond().GetSecond());
+        DeallocateControlBlock(this, alloc);
+    }
+    void* FindDeleter(uintptr_t type) {
+        if (type == TypeTag<Deleter>()) {
+            return &GetDeleter();
+        }
+        return nullptr;
+    }
+    const void* FindObject() {
+        return data.GetFirst();
+    }
+
+    CompressedPair<T*, CompressedPair<Deleter, Alloc>> data;
+};
+
+// Shared by all objects adopted with `AdoptImmortal`. It is immortal, so the manager is never
+// asked to release anything
+struct ControlBlockImmortal : public ControlBlockBase {
+    ControlBlockImmortal() {
+        counts.store(kImmortal | kWeakOne, std::memory_order_relaxed);
+        manager = &ManageControlBlock<ControlBlockImmortal>;
+    }
+
+    // Pointers to static objects may be released during static destruction
+    static ControlBlockImmortal* Instance() {
+        return &NeverDestroyed<ControlBlockImmortal>();
+    }
+
+    void Destroy() {
+    }
+    void Deallocate() {
+    }
+};
+
+class EnableSharedFromThisBase {};
+
+template <typename T, typename Policy = NonAtomicRefCount>
 class EnableSharedFromThis;
 
 class BadWeakPtr : public std::exception {};
 
-template <typename T>
+template <typename T, typename Policy = NonAtomicRefCount>
 class SharedPtr;
 
-template <typename T>
+template <typename T, typename Policy = NonAtomicRefCount>
 class WeakPtr;
+
+#ifdef SW_PTR_BLOCK_REGISTRY
+#include "registry.h"
+#endif
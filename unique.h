@@ -1,9 +1,11 @@
 #pragma once
 
 #include "compressed_pair.h"
+#include "instrument.h"
 
 #include <algorithm>
 #include <cstddef>  // std::nullptr_t
+#include <type_traits>
 #include <utility>
 
 template <typename T>
@@ -48,10 +50,16 @@ public:
 
     explicit UniquePtr(T* ptr = nullptr) {
         pair_.GetFirst() = ptr;
+        if (ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kAllocate);
+        }
     }
     UniquePtr(T* ptr, Deleter deleter) {
         pair_.GetFirst() = ptr;
         pair_.GetSecond() = std::forward<Deleter>(deleter);
+        if (ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kAllocate);
+        }
     }
 
     UniquePtr(const UniquePtr& other) = delete;
@@ -78,6 +86,7 @@ public:
         auto tmp = pair_.GetFirst();
         pair_.GetFirst() = other.pair_.GetFirst();
         if (tmp != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kDestroy);
             GetDeleter()(tmp);
         }
         other.pair_.GetFirst() = nullptr;
@@ -85,6 +94,9 @@ public:
         return *this;
     }
     UniquePtr& operator=(std::nullptr_t) {
+        if (pair_.GetFirst() != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kDestroy);
+        }
         GetDeleter()(pair_.GetFirst());
         pair_.GetFirst() = nullptr;
         return *this;
@@ -95,6 +107,7 @@ public:
 
     ~UniquePtr() {
         if (pair_.GetFirst() != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kDestroy);
             GetDeleter()(pair_.GetFirst());
         }
     }
@@ -102,15 +115,23 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Modifiers
 
+    // The object is no longer counted as live
     T* Release() {
         auto tmp = pair_.GetFirst();
+        if (tmp != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kDestroy);
+        }
         pair_.GetFirst() = nullptr;
         return tmp;
     }
     void Reset(T* ptr = nullptr) {
         auto old_ptr = pair_.GetFirst();
         pair_.GetFirst() = ptr;
+        if (ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kAllocate);
+        }
         if (old_ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T, kDestroy);
             GetDeleter()(old_ptr);
         }
     }
@@ -169,10 +190,16 @@ public:
 
     explicit UniquePtr(T* ptr = nullptr) {
         pair_.GetFirst() = ptr;
+        if (ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kAllocate);
+        }
     }
     UniquePtr(T* ptr, Deleter deleter) {
         pair_.GetFirst() = ptr;
         pair_.GetSecond() = std::forward<Deleter>(deleter);
+        if (ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kAllocate);
+        }
     }
 
     UniquePtr(const UniquePtr& other) = delete;
@@ -199,6 +226,7 @@ public:
         auto tmp = pair_.GetFirst();
         pair_.GetFirst() = other.pair_.GetFirst();
         if (tmp != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kDestroy);
             GetDeleter()(tmp);
         }
         other.pair_.GetFirst() = nullptr;
@@ -206,6 +234,9 @@ public:
         return *this;
     }
     UniquePtr& operator=(std::nullptr_t) {
+        if (pair_.GetFirst() != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kDestroy);
+        }
         GetDeleter()(pair_.GetFirst());
         pair_.GetFirst() = nullptr;
         return *this;
@@ -216,6 +247,7 @@ public:
 
     ~UniquePtr() {
         if (pair_.GetFirst() != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kDestroy);
             GetDeleter()(pair_.GetFirst());
         }
     }
@@ -223,15 +255,23 @@ public:
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Modifiers
 
+    // The object is no longer counted as live
     T* Release() {
         auto tmp = pair_.GetFirst();
+        if (tmp != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kDestroy);
+        }
         pair_.GetFirst() = nullptr;
         return tmp;
     }
     void Reset(T* ptr = nullptr) {
         auto old_ptr = pair_.GetFirst();
         pair_.GetFirst() = ptr;
+        if (ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kAllocate);
+        }
         if (old_ptr != nullptr) {
+            SW_PTR_RECORD_TYPE(T[], kDestroy);
             GetDeleter()(old_ptr);
         }
     }
@@ -279,3 +319,29 @@ public:
 private:
     CompressedPair<T*, Deleter> pair_;
 };
+
+// Relocatable unless the deleter is not
+template <typename T, typename Deleter>
+struct IsTriviallyRelocatable<UniquePtr<T, Deleter>>
+    : IsTriviallyRelocatable<CompressedPair<std::remove_extent_t<T>*, Deleter>> {};
+
+template <typename T, typename... Args>
+std::enable_if_t<!std::is_array_v<T>, UniquePtr<T>> MakeUnique(Args&&... args) {
+    return UniquePtr<T>(new T(std::forward<Args>(args)...));
+}
+template <typename T>
+std::enable_if_t<std::is_array_v<T> && std::extent_v<T> == 0, UniquePtr<T>> MakeUnique(
+    size_t size) {
+    return UniquePtr<T>(new std::remove_extent_t<T>[size]());
+}
+
+// Default-initializes instead, so trivial types are left uninitialized
+template <typename T>
+std::enable_if_t<!std::is_array_v<T>, UniquePtr<T>> MakeUniqueForOverwrite() {
+    return UniquePtr<T>(new T);
+}
+template <typename T>
+std::enable_if_t<std::is_array_v<T> && std::extent_v<T> == 0, UniquePtr<T>>
+MakeUniqueForOverwrite(size_t size) {
+    return UniquePtr<T>(new std::remove_extent_t<T>[size]);
+}
@@ -2,9 +2,11 @@
 
 #include "sw_fwd.h"  // Forward declaration
 
-template <typename T>
+template <typename T, typename Policy>
 class WeakPtr {
 public:
+    using ElementType = std::remove_extent_t<T>;
+
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Constructors
 
@@ -15,10 +17,10 @@ public:
         block_ = other.block_;
         ptr_ = other.ptr_;
         if (block_) {
-            block_->weak_cnt += 1;
+            block_->AddWeak<Policy>();
         }
     }
-    WeakPtr(WeakPtr&& other) {
+    WeakPtr(WeakPtr&& other) noexcept {
         block_ = other.block_;
         ptr_ = other.ptr_;
         other.block_ = nullptr;
@@ -26,40 +28,43 @@ public:
     }
 
     template <typename S>
-    WeakPtr(const WeakPtr<S>& other) {
+    WeakPtr(const WeakPtr<S, Policy>& other) {
         block_ = other.GetBlock();
         ptr_ = other.Get();
         if (block_) {
-            block_->weak_cnt += 1;
+            block_->AddWeak<Policy>();
         }
     }
+    // Takes over the reference of `other`, the counts are left alone
     template <typename S>
-    WeakPtr(WeakPtr<S>&& other) {
-        block_ = other.GetBlock();
+    WeakPtr(WeakPtr<S, Policy>&& other) noexcept {
         ptr_ = other.Get();
-        if (block_) {
-            block_->weak_cnt += 1;
-        }
-        other.Reset();
+        block_ = other.Detach();
     }
 
     // Demote `SharedPtr`
-    WeakPtr(const SharedPtr<T>& other) {
+    WeakPtr(const SharedPtr<T, Policy>& other) {
         block_ = other.GetBlock();
         ptr_ = other.Get();
         if (block_) {
-            block_->weak_cnt += 1;
+            block_->AddWeak<Policy>();
         }
     }
     template <typename S>
-    WeakPtr(const SharedPtr<S>& other) {
+    WeakPtr(const SharedPtr<S, Policy>& other) {
         block_ = other.GetBlock();
         ptr_ = other.Get();
         if (block_) {
-            block_->weak_cnt += 1;
+            block_->AddWeak<Policy>();
         }
     }
 
+    // Adopts a weak reference that the caller already holds on `block`
+    WeakPtr(ElementType* ptr, ControlBlockBase* block) {
+        block_ = block;
+        ptr_ = ptr;
+    }
+
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // `operator=`-s
 
@@ -71,17 +76,14 @@ public:
         block_ = other.block_;
         ptr_ = other.ptr_;
         if (block_) {
-            block_->weak_cnt += 1;
+            block_->AddWeak<Policy>();
         }
         if (tmp) {
-            tmp->weak_cnt -= 1;
-            if (tmp->strong_cnt == 0 && tmp->weak_cnt == 0) {
-                delete tmp;
-            }
+            tmp->ReleaseWeak<Policy>();
         }
         return *this;
     }
-    WeakPtr& operator=(WeakPtr&& other) {
+    WeakPtr& operator=(WeakPtr&& other) noexcept {
         if (this == &other) {
             return *this;
         }
@@ -91,10 +93,7 @@ public:
         other.block_ = nullptr;
         other.ptr_ = nullptr;
         if (tmp) {
-            tmp->weak_cnt -= 1;
-            if (tmp->strong_cnt == 0 && tmp->weak_cnt == 0) {
-                delete tmp;
-            }
+            tmp->ReleaseWeak<Policy>();
         }
         return *this;
     }
@@ -104,10 +103,7 @@ public:
 
     ~WeakPtr() {
         if (block_) {
-            block_->weak_cnt -= 1;
-            if (block_->strong_cnt == 0 && block_->weak_cnt == 0) {
-                delete block_;
-            }
+            block_->ReleaseWeak<Policy>();
         }
     }
 
@@ -119,13 +115,10 @@ public:
         block_ = nullptr;
         ptr_ = nullptr;
         if (old_block) {
-            old_block->weak_cnt -= 1;
-            if (old_block->strong_cnt == 0 && old_block->weak_cnt == 0) {
-                delete old_block;
-            }
+            old_block->ReleaseWeak<Policy>();
         }
     }
-    void Swap(WeakPtr& other) {
+    void Swap(WeakPtr& other) noexcept {
         if (this == &other) {
             return;
         }
@@ -136,13 +129,20 @@ public:
         other.block_ = tmp;
         other.ptr_ = tmp_ptr;
     }
+    // Gives up the reference without decrementing the count, the caller releases `block`
+    ControlBlockBase* Detach() noexcept {
+        auto block = block_;
+        block_ = nullptr;
+        ptr_ = nullptr;
+        return block;
+    }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////
     // Observers
 
     size_t UseCount() const {
         if (block_) {
-            return block_->strong_cnt;
+            return block_->StrongCount<Policy>();
         }
         return 0;
     }
@@ -150,26 +150,29 @@ public:
         if (!block_) {
             return true;
         }
-        if (block_->strong_cnt == 0) {
+        if (block_->StrongCount<Policy>() == 0) {
             return true;
         }
         return false;
     }
-    SharedPtr<T> Lock() const {
-        if (!Expired()) {
-            return SharedPtr(*this);
+    SharedPtr<T, Policy> Lock() const {
+        if (block_ && block_->TryAddStrong<Policy>()) {
+            return SharedPtr<T, Policy>(ptr_, block_);
         }
-        return SharedPtr<T>();
+        return SharedPtr<T, Policy>();
     }
 
     ControlBlockBase* GetBlock() const {
         return block_;
     }
-    T* Get() const {
+    ElementType* Get() const {
         return ptr_;
     }
 
 private:
     ControlBlockBase* block_;
-    T* ptr_;
+    ElementType* ptr_;
 };
+
+template <typename T, typename Policy>
+struct IsTriviallyRelocatable<WeakPtr<T, Policy>> : std::true_type {};
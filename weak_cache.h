@@ -0,0 +1,142 @@
+#pragma once
+
+#include "shared.h"
+#include "weak.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Cache of objects that are alive anyway.
+//
+// Entries are `WeakPtr`s, so the cache never keeps an object alive: a lookup hands out the
+// object while anybody still holds it, otherwise the factory creates a new one. Keys are spread
+// over independently locked shards. Each insert also checks a few buckets of its shard for
+// expired entries, so a shard never holds much more than its live objects plus the entries that
+// expired since the last full pass over it.
+
+template <typename K, typename V, typename Hash = std::hash<K>, typename Policy = AtomicRefCount>
+class WeakCache {
+    static_assert(Policy::kThreadSafe, "Objects of a shared cache are released on any thread");
+
+    // Buckets checked for expired entries per insert
+    static constexpr size_t kSweepBuckets = 2;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<K, WeakPtr<V, Policy>, Hash> entries;
+        size_t sweep_bucket = 0;
+    };
+
+public:
+    // `shards` is rounded up to a power of two
+    explicit WeakCache(size_t shards = 16, const Hash& hash = Hash()) : hash_(hash) {
+        while ((size_t{1} << shard_bits_) < shards) {
+            ++shard_bits_;
+        }
+        shards_.reset(new Shard[size_t{1} << shard_bits_]);
+    }
+
+    WeakCache(const WeakCache& other) = delete;
+    WeakCache& operator=(const WeakCache& other) = delete;
+
+    // Returns the cached object, or stores and returns `factory()`. The factory runs without the
+    // shard locked; if another thread stores an object for `key` meanwhile, that one is returned
+    // and the new one dropped
+    template <typename Factory>
+    SharedPtr<V, Policy> GetOrCreate(const K& key, Factory&& factory) {
+        Shard& shard = ShardFor(key);
+        if (auto found = Find(shard, key)) {
+            return found;
+        }
+        SharedPtr<V, Policy> created = factory();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto [it, inserted] = shard.entries.try_emplace(key, created);
+        if (!inserted) {
+            if (auto found = it->second.Lock()) {
+                return found;
+            }
+            it->second = created;
+        }
+        Sweep(shard, kSweepBuckets);
+        return created;
+    }
+
+    // Null unless the object for `key` is still alive
+    SharedPtr<V, Policy> Find(const K& key) {
+        return Find(ShardFor(key), key);
+    }
+
+    void Erase(const K& key) {
+        Shard& shard = ShardFor(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.erase(key);
+    }
+
+    // Removes every expired entry
+    void Sweep() {
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            Sweep(shards_[i], shards_[i].entries.bucket_count());
+        }
+    }
+
+    // Entries including expired ones that weren't swept yet
+    size_t Size() const {
+        size_t size = 0;
+        for (size_t i = 0; i < ShardCount(); ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex);
+            size += shards_[i].entries.size();
+        }
+        return size;
+    }
+    size_t ShardCount() const {
+        return size_t{1} << shard_bits_;
+    }
+
+private:
+    Shard& ShardFor(const K& key) const {
+        if (shard_bits_ == 0) {
+            return shards_[0];
+        }
+        // The map uses the low bits of the same hash, so the shard is taken from the high ones
+        uint64_t hash = static_cast<uint64_t>(hash_(key)) * 0x9E3779B97F4A7C15ull;
+        return shards_[hash >> (64 - shard_bits_)];
+    }
+
+    SharedPtr<V, Policy> Find(Shard& shard, const K& key) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            return SharedPtr<V, Policy>();
+        }
+        return it->second.Lock();
+    }
+
+    // Checks `buckets` buckets after the one where the previous call stopped
+    void Sweep(Shard& shard, size_t buckets) {
+        auto& entries = shard.entries;
+        size_t bucket_count = entries.bucket_count();
+        std::vector<K> expired;
+        for (size_t i = 0; i < buckets && i < bucket_count; ++i) {
+            size_t bucket = shard.sweep_bucket++ % bucket_count;
+            for (auto it = entries.begin(bucket); it != entries.end(bucket); ++it) {
+                if (it->second.Expired()) {
+                    expired.push_back(it->first);
+                }
+            }
+        }
+        for (const K& key : expired) {
+            entries.erase(key);
+        }
+    }
+
+    Hash hash_;
+    size_t shard_bits_ = 0;
+    std::unique_ptr<Shard[]> shards_;
+};